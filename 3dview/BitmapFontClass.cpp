@@ -3,17 +3,77 @@
 
 using namespace std;
 
+// Text is drawn as textured quads in pixel coordinates, Screen maps them to clip space
+static const char *FontVertexShader =
+    "#version 330 core\n"
+    "layout(location = 0) in vec2 Position;\n"
+    "layout(location = 1) in vec2 TexCoord;\n"
+    "uniform vec4 Screen;\n"
+    "out vec2 UV;\n"
+    "void main()\n"
+    "{\n"
+    "    UV = TexCoord;\n"
+    "    gl_Position = vec4(Position * Screen.xy + Screen.zw, 0.0, 1.0);\n"
+    "}\n";
+
+// Greyscale fonts live in the red channel, which is spread to RGB the way GL_LUMINANCE used to
+static const char *FontFragmentShader =
+    "#version 330 core\n"
+    "uniform sampler2D Map;\n"
+    "uniform vec3 Color;\n"
+    "uniform bool Luminance;\n"
+    "in vec2 UV;\n"
+    "out vec4 FragColor;\n"
+    "void main()\n"
+    "{\n"
+    "    vec4 Texel = texture(Map, UV);\n"
+    "    if (Luminance)\n"
+    "        Texel = vec4(Texel.rrr, 1.0);\n"
+    "    FragColor = vec4(Color, 1.0) * Texel;\n"
+    "}\n";
+
+static GLuint CompileShader(GLenum Type, const char *Source)
+{
+    GLuint Shader=glCreateShader(Type);
+    glShaderSource(Shader,1,&Source,NULL);
+    glCompileShader(Shader);
+
+    GLint Status;
+    glGetShaderiv(Shader,GL_COMPILE_STATUS,&Status);
+    if(!Status)
+    {
+        glDeleteShader(Shader);
+        return 0;
+    }
+    return Shader;
+}
+
 CBitmapFont::CBitmapFont()
 {
     CurX=CurY=0;
     Rd=Gr=Bl=1.0f;
     InvertYAxis=false;
+    TexID=0;
+    Program=VertexArray=VertexBuffer=0;
+    Screen[0]=Screen[1]=1.0f;
+    Screen[2]=Screen[3]=0.0f;
 }
 
 CBitmapFont::~CBitmapFont()
 {
 }
 
+// Deletes the GL objects the font made, which has to happen while the context is still alive
+void CBitmapFont::Release()
+{
+    glDeleteProgram(Program);
+    glDeleteVertexArrays(1,&VertexArray);
+    glDeleteBuffers(1,&VertexBuffer);
+    glDeleteTextures(1,&TexID);
+    TexID=0;
+    Program=VertexArray=VertexBuffer=0;
+}
+
 bool CBitmapFont::Load(const TCHAR *fname)
 {
     fstream in;
@@ -123,7 +183,9 @@ bool CBitmapFont::Load(const TCHAR *fname)
     switch(RenderStyle)
     {
         case BFG_RS_ALPHA:
-        glTexImage2D(GL_TEXTURE_2D,0,GL_LUMINANCE,ImgX,ImgY,0,GL_LUMINANCE,GL_UNSIGNED_BYTE,img);
+        glPixelStorei(GL_UNPACK_ALIGNMENT,1);
+        glTexImage2D(GL_TEXTURE_2D,0,GL_R8,ImgX,ImgY,0,GL_RED,GL_UNSIGNED_BYTE,img);
+        glPixelStorei(GL_UNPACK_ALIGNMENT,4);
         break;
 
         case BFG_RS_RGB:
@@ -139,6 +201,53 @@ bool CBitmapFont::Load(const TCHAR *fname)
     delete [] img;
     delete [] dat;
   
+    return CreateProgram();
+}
+
+// Builds the shader program and the vertex array used to stream character quads
+bool CBitmapFont::CreateProgram()
+{
+    GLuint Vertex=CompileShader(GL_VERTEX_SHADER,FontVertexShader);
+    GLuint Fragment=CompileShader(GL_FRAGMENT_SHADER,FontFragmentShader);
+    if(Vertex==0 || Fragment==0)
+    {
+        glDeleteShader(Vertex);
+        glDeleteShader(Fragment);
+        return false;
+    }
+
+    GLuint Prog=glCreateProgram();
+    glAttachShader(Prog,Vertex);
+    glAttachShader(Prog,Fragment);
+    glLinkProgram(Prog);
+    glDeleteShader(Vertex);
+    glDeleteShader(Fragment);
+
+    GLint Status;
+    glGetProgramiv(Prog,GL_LINK_STATUS,&Status);
+    if(!Status)
+    {
+        glDeleteProgram(Prog);
+        return false;
+    }
+
+    Program=Prog;
+    ScreenLoc=glGetUniformLocation(Program,"Screen");
+    ColorLoc=glGetUniformLocation(Program,"Color");
+    LuminanceLoc=glGetUniformLocation(Program,"Luminance");
+
+    // Each vertex is x, y in pixels followed by u, v
+    glGenVertexArrays(1,&VertexArray);
+    glGenBuffers(1,&VertexBuffer);
+    glBindVertexArray(VertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER,VertexBuffer);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(0,2,GL_FLOAT,GL_FALSE,4*sizeof(float),(const void *)0);
+    glVertexAttribPointer(1,2,GL_FLOAT,GL_FALSE,4*sizeof(float),(const void *)(2*sizeof(float)));
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER,0);
+
     return true;
 }
 
@@ -155,10 +264,11 @@ void CBitmapFont::Bind()
     glBindTexture(GL_TEXTURE_2D, TexID);
 }
 
-// Set the color and blending options based on the Renderstyle member
+// Set the color and blending options based on the Renderstyle member, the font program must be in use
 void CBitmapFont::SetBlend()
 {
-    glColor3f(Rd,Gr,Bl);
+    glUniform3f(ColorLoc,Rd,Gr,Bl);
+    glUniform1i(LuminanceLoc,RenderStyle==BFG_RS_ALPHA);
 
     switch(RenderStyle)
     {
@@ -178,10 +288,11 @@ void CBitmapFont::SetBlend()
     }
  }
 
-// Shortcut, Enables Texturing and performs Bind and SetBlend
+// Shortcut, selects the font program and performs Bind and SetBlend
 void CBitmapFont::Select()
 {
-    glEnable(GL_TEXTURE_2D);
+    glUseProgram(Program);
+    glUniform4fv(ScreenLoc,1,Screen);
     Bind();
     SetBlend();
 }
@@ -205,28 +316,47 @@ void CBitmapFont::ReverseYAxis(bool State)
   InvertYAxis=State;
  }
 
-// Sets up an Ortho screen based on the supplied values 
+// Sets up an Ortho screen based on the supplied values, taking effect on the next Select
 void CBitmapFont::SetScreen(int x, int y)
 {
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
+    Screen[0]=2.0f/x;
+    Screen[2]=-1.0f;
     if(InvertYAxis)
-        glOrtho(0,x,y,0,-1,1);
+    {
+        Screen[1]=-2.0f/y;
+        Screen[3]=1.0f;
+    }
     else
-        glOrtho(0,x,0,y,-1,1);
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+    {
+        Screen[1]=2.0f/y;
+        Screen[3]=-1.0f;
+    }
 }
 
 // Prints text at the cursor position, cursor is moved to end of text
 void CBitmapFont::Print(const char* Text)
+{
+    Render(Text,YOffset);
+}
+
+// Prints text at a specifed position, again cursor is updated
+void CBitmapFont::Print(const char* Text, int x, int y)
+{
+    CurX=x;
+    CurY=y;
+    Render(Text,CellY);
+}
+
+// Streams two triangles per character into the vertex buffer and draws them, the font must be selected
+void CBitmapFont::Render(const char *Text, int Height)
 {
     size_t sLen=strnlen(Text,BFG_MAXSTRING);
 
     if (sLen == 0)
         return;
 
-    glBegin(GL_QUADS);
+    float Vertices[BFG_MAXSTRING*6*4];
+    float *v=Vertices;
 
     for (size_t Loop=0;Loop!=sLen;++Loop)
     {
@@ -240,101 +370,71 @@ void CBitmapFont::Print(const char* Text)
         U1=U+ColFactor;
         V1=V+RowFactor;
 
-        glTexCoord2f(U, V1); glVertex2i(CurX,      CurY);
-        glTexCoord2f(U1,V1); glVertex2i(CurX+CellX,CurY);
-        glTexCoord2f(U1,V ); glVertex2i(CurX+CellX,CurY+YOffset);
-        glTexCoord2f(U, V ); glVertex2i(CurX,      CurY+YOffset);
+        float X=(float)CurX, X1=(float)(CurX+CellX);
+        float Y=(float)CurY, Y1=(float)(CurY+Height);
+        float Quad[6*4]=
+        {
+            X, Y, U, V1,   X1,Y, U1,V1,   X1,Y1,U1,V,
+            X, Y, U, V1,   X1,Y1,U1,V,    X, Y1,U, V
+        };
+        memcpy(v,Quad,sizeof(Quad));
+        v+=6*4;
 
         CurX+=Width[Text[Loop]];
     }
 
-    glEnd();
+    glBindVertexArray(VertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER,VertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER,(v-Vertices)*sizeof(float),Vertices,GL_STREAM_DRAW);
+    glDrawArrays(GL_TRIANGLES,0,(GLsizei)(sLen*6));
+    glBindBuffer(GL_ARRAY_BUFFER,0);
 }
 
-// Prints text at a specifed position, again cursor is updated
-void CBitmapFont::Print(const char* Text, int x, int y)
- {
-  int sLen,Loop;
-  int Row,Col;
-  float U,V,U1,V1;
-
-  CurX=x;
-  CurY=y;
-    
-  sLen=(int)strnlen(Text,BFG_MAXSTRING);
-
-  glBegin(GL_QUADS);
-
-   for(Loop=0;Loop!=sLen;++Loop)
-    {
-     Row=(Text[Loop]-Base)/RowPitch;
-     Col=(Text[Loop]-Base)-Row*RowPitch;
-
-     U=Col*ColFactor;
-     V=Row*RowFactor;
-     U1=U+ColFactor;
-     V1=V+RowFactor;
-
-     glTexCoord2f(U, V1);  glVertex2i(CurX,      CurY);
-     glTexCoord2f(U1,V1);  glVertex2i(CurX+CellX,CurY);
-     glTexCoord2f(U1,V ); glVertex2i(CurX+CellX,CurY+CellY);
-     glTexCoord2f(U, V ); glVertex2i(CurX,      CurY+CellY);
-
-     CurX+=Width[Text[Loop]];
-    }
-   glEnd();
- }
-
 // Lazy way to draw text.
-// Preserves all GL attributes and does everything for you.
+// Preserves the GL state it touches and does everything for you.
 // Performance could be an issue.
 void CBitmapFont::ezPrint(const char *Text, int x, int y)
 {
-    if (Text[0] == '\0')
+    if (Text[0] == '\0' || Program == 0)
         return;
 
-    GLint CurMatrixMode;
     GLint ViewPort[4];
+    GLint CurProgram, CurVertexArray, CurBlendSrc, CurBlendDst;
+    GLboolean CurDepthMask;
 
     // Save current setup
-    glGetIntegerv(GL_MATRIX_MODE,&CurMatrixMode);
     glGetIntegerv(GL_VIEWPORT,ViewPort);
-    glPushAttrib(GL_ALL_ATTRIB_BITS);
+    glGetIntegerv(GL_CURRENT_PROGRAM,&CurProgram);
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING,&CurVertexArray);
+    glGetIntegerv(GL_BLEND_SRC_RGB,&CurBlendSrc);
+    glGetIntegerv(GL_BLEND_DST_RGB,&CurBlendDst);
+    glGetBooleanv(GL_DEPTH_WRITEMASK,&CurDepthMask);
+    GLboolean CurDepthTest=glIsEnabled(GL_DEPTH_TEST);
+    GLboolean CurBlend=glIsEnabled(GL_BLEND);
 
     // Setup projection
-    glMatrixMode(GL_PROJECTION);
-    glPushMatrix();
-    glLoadIdentity();
-    if(InvertYAxis)
-        glOrtho(0,ViewPort[2],ViewPort[3],0,-1,1);
-    else
-        glOrtho(0,ViewPort[2],0,ViewPort[3],-1,1);
+    SetScreen(ViewPort[2],ViewPort[3]);
     glDisable(GL_DEPTH_TEST);
     glDepthMask(false);
 
-    // Setup Modelview
-    glMatrixMode(GL_MODELVIEW);
-    glPushMatrix();
-    glLoadIdentity();
-
-    // Setup Texture, color and blend options
-    glEnable(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D,TexID);
-    SetBlend();
+    // Setup program, texture, color and blend options
+    Select();
 
     // Render text
     Print(Text,x,y);
 
     glBindTexture(GL_TEXTURE_2D, 0);
     // Restore previous state
-    glPopAttrib();
-
-    glMatrixMode(GL_PROJECTION);
-    glPopMatrix();
-    glMatrixMode(GL_MODELVIEW);
-    glPopMatrix();
-
-    glMatrixMode(CurMatrixMode);
+    glUseProgram(CurProgram);
+    glBindVertexArray(CurVertexArray);
+    glBlendFunc(CurBlendSrc,CurBlendDst);
+    glDepthMask(CurDepthMask);
+    if(CurDepthTest)
+        glEnable(GL_DEPTH_TEST);
+    if(CurBlend)
+        glEnable(GL_BLEND);
+    else
+        glDisable(GL_BLEND);
  }
 
 // Returns the width in pixels of the specified text
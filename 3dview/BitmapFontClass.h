@@ -35,6 +35,7 @@ class CBitmapFont
    CBitmapFont();
    ~CBitmapFont();
    bool Load(const TCHAR *fname);
+   void Release();
    void SetScreen(int x, int y); 
    void SetCursor(int x, int y); 
    void SetColor(float Red, float Green, float Blue);
@@ -49,6 +50,8 @@ class CBitmapFont
    
 
   private:
+   bool CreateProgram();
+   void Render(const char *Text, int Height);
    int CellX,CellY,YOffset,RowPitch;
    char Base;
    char Width[256];   
@@ -58,6 +61,9 @@ class CBitmapFont
    int RenderStyle;
    float Rd,Gr,Bl;
    bool InvertYAxis;
+   GLuint Program,VertexArray,VertexBuffer;
+   GLint ScreenLoc,ColorLoc,LuminanceLoc;
+   float Screen[4];
  };
 
 #endif
\ No newline at end of file
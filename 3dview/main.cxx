@@ -4,9 +4,11 @@
 #endif
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <locale.h>
 
 #include "BitmapFontClass.h"
 #include <glad/glad.h>
@@ -16,10 +18,56 @@
 #include <windows.h>
 #include <tchar.h>
 
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+ #define HAVE_SSE2 1
+ #include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+ #include <intrin.h>
+#endif
+
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <future>
 #include <memory>
+#include <queue>
+#include <random>
+#include <thread>
 #include <unordered_map>
-#include <unordered_set>
+#include <vector>
+
+// How read_stl merges facet corners into shared vertices
+enum class WeldMode
+{
+    Hash,   // probe a hash table per corner
+    Sort,   // radix sort all corners and scan for runs
+};
+
+static WeldMode weld_mode = WeldMode::Hash;
+
+// Vertices closer than this (in model units) are merged after loading, 0 keeps exact welding only
+static float weld_tolerance = 0.0f;
+
+// Normals of merged vertices are shared when they are within a degree of each other
+static const float weld_normal_cos = 0.9998477f;
+
+// When non zero read_stl welds on position only, then splits vertex normals where
+// neighbouring facets meet at more than this many degrees
+static float crease_angle = 0.0f;
+
+// Facets meeting at more than this many degrees make a feature edge
+static float feature_angle = 30.0f;
+
+// Meshes with more triangles than this get simplified levels of detail to draw when small on screen
+static const size_t lod_min_triangles = 100000;
+
+// After loading, meshes are split into connected parts in the background and repeated copies of a
+// part are drawn as instances of one shared mesh. Parts with fewer triangles than
+// instance_min_triangles are left where they are.
+static bool find_duplicates = true;
+static const size_t instance_min_triangles = 32;
 
 static GLfloat alpha = 210.f, beta = -70.f;
 static GLfloat zoom = 8.f;
@@ -27,6 +75,10 @@ static GLfloat zoom = 8.f;
 static double cursorX;
 static double cursorY;
 
+// Set whenever what is on screen is out of date, the main loop only draws when it is set.
+// Background tasks set it too and then post an empty event to wake the loop.
+static std::atomic<bool> redraw_needed{ true };
+
 static void debug_print(const char *s, ...)
 {
     char buf[1024];
@@ -37,6 +89,161 @@ static void debug_print(const char *s, ...)
     OutputDebugStringA(buf);
 }
 
+static size_t worker_count()
+{
+    unsigned int n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : n;
+}
+
+// Calls fn(i) for every i in [0, count), spreading the calls over up to worker_count() threads
+template <typename Fn>
+static void parallel_for(size_t count, Fn fn)
+{
+    size_t n_threads = (std::min)(worker_count(), count);
+    if (n_threads <= 1)
+    {
+        for (size_t i = 0; i < count; ++i)
+            fn(i);
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    auto work = [&]()
+    {
+        for (size_t i = next++; i < count; i = next++)
+            fn(i);
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < n_threads; ++t)
+        threads.emplace_back(work);
+    work();
+    for (auto &t : threads)
+        t.join();
+}
+
+// First item of chunk c when count items are split into n_chunks nearly equal chunks
+static size_t chunk_begin(size_t c, size_t n_chunks, size_t count)
+{
+    return (size_t)((unsigned long long)count * c / n_chunks);
+}
+
+// Stable LSD radix sort of 64 bit keys carrying a value each, one byte per pass.
+// Every pass counts digits per chunk in parallel, then scatters each chunk to its own offsets.
+// Passes where all keys share the same digit are skipped, so small keys cost fewer passes.
+static void radix_sort(std::vector<uint64_t> &keys, std::vector<unsigned int> &values)
+{
+    size_t n = keys.size();
+    size_t n_chunks = (std::max)((size_t)1, (std::min)(worker_count() * 4, n / 65536));
+    std::vector<uint64_t> keys_out(n);
+    std::vector<unsigned int> values_out(n);
+    std::vector<std::array<size_t, 256>> offsets(n_chunks);
+
+    for (int shift = 0; shift < 64; shift += 8)
+    {
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            std::array<size_t, 256> &count = offsets[c];
+            count.fill(0);
+            size_t end = chunk_begin(c + 1, n_chunks, n);
+            for (size_t i = chunk_begin(c, n_chunks, n); i < end; ++i)
+                ++count[(keys[i] >> shift) & 0xff];
+        });
+
+        size_t total = 0;
+        bool single_digit = false;
+        for (int d = 0; d < 256 && !single_digit; ++d)
+        {
+            size_t digit_count = 0;
+            for (size_t c = 0; c < n_chunks; ++c)
+                digit_count += offsets[c][d];
+            single_digit = digit_count == n;
+        }
+        if (single_digit)
+            continue;
+
+        for (int d = 0; d < 256; ++d)
+        {
+            for (size_t c = 0; c < n_chunks; ++c)
+            {
+                size_t digit_count = offsets[c][d];
+                offsets[c][d] = total;
+                total += digit_count;
+            }
+        }
+
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            std::array<size_t, 256> &offset = offsets[c];
+            size_t end = chunk_begin(c + 1, n_chunks, n);
+            for (size_t i = chunk_begin(c, n_chunks, n); i < end; ++i)
+            {
+                size_t to = offset[(keys[i] >> shift) & 0xff]++;
+                keys_out[to] = keys[i];
+                values_out[to] = values[i];
+            }
+        });
+        keys.swap(keys_out);
+        values.swap(values_out);
+    }
+}
+
+// Splits sorted keys into n_chunks nearly equal chunks, each moved forward to start on a run of equal keys
+static std::vector<size_t> run_chunks(const std::vector<uint64_t> &keys, size_t n_chunks)
+{
+    size_t n = keys.size();
+    std::vector<size_t> starts(n_chunks + 1);
+    for (size_t c = 0; c <= n_chunks; ++c)
+    {
+        size_t i = chunk_begin(c, n_chunks, n);
+        while (i > 0 && i < n && keys[i] == keys[i - 1])
+            ++i;
+        starts[c] = i;
+    }
+    return starts;
+}
+
+// After radix_sort of keys carrying item numbers in order, sets leader[item] to the lowest numbered item
+// equal to it. Items with the same key are usually equal, but collisions (and NaN) are split with equal().
+template <typename Equal>
+static void find_leaders(const std::vector<uint64_t> &keys, const std::vector<unsigned int> &order, size_t n_chunks, Equal equal, std::vector<unsigned int> &leader)
+{
+    std::vector<size_t> run_chunk = run_chunks(keys, n_chunks);
+    parallel_for(n_chunks, [&](size_t c)
+    {
+        std::vector<unsigned int> heads;
+        size_t end = run_chunk[c + 1];
+        for (size_t begin = run_chunk[c]; begin < end; )
+        {
+            size_t run_end = begin + 1;
+            while (run_end < end && keys[run_end] == keys[begin])
+                ++run_end;
+
+            // The sort is stable so the run lists its items in ascending order
+            size_t i = begin;
+            while (i < run_end && equal(order[i], order[begin]))
+                leader[order[i++]] = order[begin];
+
+            if (i < run_end)
+            {
+                heads.clear();
+                if (i > begin)
+                    heads.push_back(order[begin]);
+                for (; i < run_end; ++i)
+                {
+                    unsigned int item = order[i];
+                    size_t h = 0;
+                    while (h < heads.size() && !equal(heads[h], item))
+                        ++h;
+                    if (h == heads.size())
+                        heads.push_back(item);
+                    leader[item] = heads[h];
+                }
+            }
+            begin = run_end;
+        }
+    });
+}
+
 #if 0
 static void debug_matrix(const char *s, mat4x4 mat)
 {
@@ -181,6 +388,12 @@ struct Box
         return c;
     }
 
+    float area() const
+    {
+        float dx = xmax - xmin, dy = ymax - ymin, dz = zmax - zmin;
+        return 2.0f * (dx * dy + dy * dz + dz * dx);
+    }
+
     float size() const
     {
         return (std::max)(xmax - xmin, (std::max)(ymax - ymin, zmax - zmin));
@@ -221,6 +434,12 @@ struct VertexRecord
     }
 };
 
+// Normal a facet corner is welded with, zero when welding on position only
+static inline Vector weld_normal(const Vector &n)
+{
+    return crease_angle > 0.0f ? Vector{ 0.0f, 0.0f, 0.0f } : n;
+}
+
 struct Record
 {
     float normal[3];
@@ -230,331 +449,3129 @@ struct Record
     unsigned short attribs;
 };
 
-struct Hasher
+#pragma pack(push, 1)
+// On-disk layout of a binary STL facet, used to walk a mapped file in place
+struct PackedRecord
+{
+    float normal[3];
+    Vector vertex1;
+    Vector vertex2;
+    Vector vertex3;
+    unsigned short attribs;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(PackedRecord) == 50, "binary STL facets are 50 bytes");
+
+// Read only view of a whole file mapped into memory
+struct MappedFile
 {
-    unsigned int operator() (const VertexRecord &r) const
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    bool open(const char *filename)
     {
-        return operator()(r.point);
+        close();
+        file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0 || (unsigned long long)file_size.QuadPart > SIZE_MAX)
+        {
+            close();
+            return false;
+        }
+
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr)
+        {
+            close();
+            return false;
+        }
+
+        data = (const unsigned char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (data == nullptr)
+        {
+            close();
+            return false;
+        }
+        size = (size_t)file_size.QuadPart;
+        return true;
     }
 
-    unsigned int operator() (const Vector &v) const
+    void close()
     {
-        return *(unsigned int *)&v.x ^ * (unsigned int *)&v.y ^ * (unsigned int *)&v.z;
+        if (data != nullptr)
+            UnmapViewOfFile(data);
+        if (mapping != nullptr)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+        mapping = nullptr;
+        data = nullptr;
+        size = 0;
     }
 };
 
-struct Color
+static inline unsigned int first_set_bit(unsigned int mask)
 {
-    float r, g, b;
-};
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
 
-struct Mesh
+static inline bool is_space(char c)
 {
-    std::vector<Vector> vertices;
-    std::vector<Vector> normals;
-    typedef std::unordered_map<VertexRecord, unsigned int, Hasher> IndexMap;
-    IndexMap indices;
-    std::vector<unsigned int> triangles;
-    std::vector<unsigned int> edges;
-    Vector center;
-    Color color;
-    Box box;
-    bool box_cached = false;
-    bool include_in_scene_box = true;
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
 
-    Mesh()
-    {
-        color.r = 0.8f;
-        color.g = 0.7f;
-        color.b = 0.6f;
-    }
+#if HAVE_SSE2
+// Bit i set when byte i of the block is a token separator
+static inline unsigned int space_mask(const char *p)
+{
+    __m128i block = _mm_loadu_si128((const __m128i *)p);
+    __m128i ws = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\t'))),
+        _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\n'))));
+    return (unsigned int)_mm_movemask_epi8(ws);
+}
+#endif
 
-    unsigned int get_index(const Vector &v, const Vector &n)
+// Splits a text buffer into whitespace separated tokens which point into the buffer
+struct Tokenizer
+{
+    const char *p;
+    const char *end;
+
+    bool next(const char *&token, size_t &length)
     {
-        VertexRecord r = { v, n };
-        auto it = indices.find(r);
-        if (it != indices.end())
-            return it->second;
-        box_cached = false;
-        indices.insert(std::make_pair(r, (int)indices.size()));
-        vertices.push_back(v);
-        normals.push_back(n);
-        return (int)vertices.size() - 1;
+        skip_space();
+        if (p == end)
+            return false;
+        token = p;
+        skip_token();
+        length = p - token;
+        return true;
     }
 
-    void read_stl(const char *filename)
+    void skip_space()
     {
-        FILE *fp = fopen(filename, "rb");
-        if (fp == nullptr)
-            return;
-        char buf[80];
-        fread(buf, 1, 6, fp);
-
-        if (_strnicmp(buf, "solid ", 6) == 0)
-            read_ascii_stl(fp);
-        else
+#if HAVE_SSE2
+        while (end - p >= 16)
         {
-            fread(buf, 1, 74, fp);
-            read_binary_stl(fp);
+            unsigned int mask = space_mask(p) ^ 0xffff;
+            if (mask != 0)
+            {
+                p += first_set_bit(mask);
+                return;
+            }
+            p += 16;
         }
-        fclose(fp);
-        make_edges();
+#endif
+        while (p != end && is_space(*p))
+            ++p;
     }
 
-    void read_token(FILE *fp, char *token, size_t max_token)
+    void skip_token()
     {
-        int n = 0;
-        for (;;)
+#if HAVE_SSE2
+        while (end - p >= 16)
         {
-            int c = fgetc(fp);
-            if (c == EOF || c == ' ' || c == '\t' || c == '\r' || c == '\n')
+            unsigned int mask = space_mask(p);
+            if (mask != 0)
             {
-                if (c != EOF && n == 0)
-                    continue;
-                break;
+                p += first_set_bit(mask);
+                return;
             }
-            token[n++] = c;
+            p += 16;
         }
-        token[n] = '\0';
+#endif
+        while (p != end && !is_space(*p))
+            ++p;
     }
+};
+
+template <size_t N>
+static inline bool token_is(const char *token, size_t length, const char (&keyword)[N])
+{
+    return length == N - 1 && memcmp(token, keyword, N - 1) == 0;
+}
+
+// Locale independent strtof for the numbers the fast path below cannot round exactly
+static bool parse_real_slow(const char *token, size_t length, float *f)
+{
+    char buf[128];
+    if (length >= sizeof(buf))
+        return false;
+    memcpy(buf, token, length);
+    buf[length] = '\0';
 
-    bool parse_real(const char *token, float *f)
+    char *end;
+#if defined(_MSC_VER)
+    static _locale_t c_locale = _create_locale(LC_NUMERIC, "C");
+    float v = _strtof_l(buf, &end, c_locale);
+#else
+    static locale_t c_locale = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+    float v = strtof_l(buf, &end, c_locale);
+#endif
+    if (*end != '\0' || isinf(v))
+        return false;
+    *f = v;
+    return true;
+}
+
+// Parses a decimal number such as 1.234560e+02 into the nearest float, independent of the locale.
+// Up to 19 significant digits are gathered into an integer; when that integer and the power of ten
+// are both exact doubles the quotient or product is the correctly rounded double, and rounding
+// that on to float is exact unless it lands on a halfway point between two floats.
+static bool parse_real(const char *token, size_t length, float *f)
+{
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    const char *p = token;
+    const char *end = token + length;
+    bool negative = false;
+    if (p != end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool truncated = false;
+    bool any_digit = false;
+    for (; p != end && *p >= '0' && *p <= '9'; ++p)
     {
-        char *end;
-        double d = strtod(token, &end);
-        if (*end == '\0')
+        any_digit = true;
+        if (digits < 19)
         {
-            if (d > FLT_MAX || d < -FLT_MAX)
-                return false;
-            *f = (float)d;
-            return true;
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa != 0)
+                ++digits;
+        }
+        else
+        {
+            ++exponent;
+            truncated |= *p != '0';
         }
-        return false;
     }
-
-    bool read_ascii_stl(FILE *fp)
+    if (p != end && *p == '.')
     {
-        int state = 0;
-        Record r;
-        bool first = true;
-        for (;;)
+        for (++p; p != end && *p >= '0' && *p <= '9'; ++p)
         {
-            char token[512];
-            read_token(fp, token, sizeof(token));
-            if (token[0] == '\0')
-                break;
-            int oldstate = state;
-            switch (state)
-            {
-            case 0:
-                if (strcmp(token, "facet") == 0) ++state;
-                if (strcmp(token, "endsolid") == 0)
-                    return true;
-                break;
-            case 1:
-                if (strcmp(token, "normal") == 0) ++state;
-                break;
-            case 2:
-                if (parse_real(token, &r.normal[0])) ++state;
-                break;
-            case 3:
-                if (parse_real(token, &r.normal[1])) ++state;
-                break;
-            case 4:
-                if (parse_real(token, &r.normal[2])) ++state;
-                break;
-            case 5:
-                if (strcmp(token, "outer") == 0) ++state;
-                break;
-            case 6:
-                if (strcmp(token, "loop") == 0) ++state;
-                break;
-            case 7:
-                if (strcmp(token, "vertex") == 0) ++state;
-                break;
-            case 8:
-                if (parse_real(token, &r.vertex1.x)) ++state;
-                break;
-            case 9:
-                if (parse_real(token, &r.vertex1.y)) ++state;
-                break;
-            case 10:
-                if (parse_real(token, &r.vertex1.z)) ++state;
-                break;
-            case 11:
-                if (strcmp(token, "vertex") == 0) ++state;
-                break;
-            case 12:
-                if (parse_real(token, &r.vertex2.x)) ++state;
-                break;
-            case 13:
-                if (parse_real(token, &r.vertex2.y)) ++state;
-                break;
-            case 14:
-                if (parse_real(token, &r.vertex2.z)) ++state;
-                break;
-            case 15:
-                if (strcmp(token, "vertex") == 0) ++state;
-                break;
-            case 16:
-                if (parse_real(token, &r.vertex3.x)) ++state;
-                break;
-            case 17:
-                if (parse_real(token, &r.vertex3.y)) ++state;
-                break;
-            case 18:
-                if (parse_real(token, &r.vertex3.z)) ++state;
-                break;
-            case 19:
-                if (strcmp(token, "endloop") == 0) ++state;
-                break;
-            case 20:
-                if (strcmp(token, "endfacet") == 0)
-                {
-
-                    Vector a = r.vertex2 - r.vertex1;
-                    Vector b = r.vertex3 - r.vertex1;
-                    Vector n = cross(a, b);
-                    n /= n.length();
-                    unsigned int i1 = get_index(r.vertex1, n);
-                    unsigned int i2 = get_index(r.vertex2, n);
-                    unsigned int i3 = get_index(r.vertex3, n);
-                    triangles.push_back(i1);
-                    triangles.push_back(i2);
-                    triangles.push_back(i3);
-                    state = 0;
-                }
-                break;
-            }
-
-            if (!first && oldstate == state)
+            any_digit = true;
+            if (digits < 19)
             {
-                debug_print("unrecognize token %s\n", token);
-                return false; // unrecognized token or out of order token
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa != 0)
+                    ++digits;
+                --exponent;
             }
-            first = false;
+            else
+                truncated |= *p != '0';
         }
-        return true;
     }
+    if (!any_digit)
+        return parse_real_slow(token, length, f);
 
-    bool read_binary_stl(FILE *fp)
+    if (p != end && (*p == 'e' || *p == 'E'))
     {
-        unsigned int n_triangles;
-        if (fread(&n_triangles, sizeof(unsigned int), 1, fp) != 1)
+        ++p;
+        bool negative_exponent = false;
+        if (p != end && (*p == '-' || *p == '+'))
+            negative_exponent = *p++ == '-';
+        if (p == end || *p < '0' || *p > '9')
             return false;
-        for (unsigned int i = 0; i < n_triangles; ++i)
+        int e = 0;
+        for (; p != end && *p >= '0' && *p <= '9'; ++p)
         {
-            Record r;
-            size_t n_read = fread(&r, 1, 50, fp);
-            if (n_read <= 0)
-                break;
-            if (n_read != 50)
-                return false;
-            Vector a = r.vertex2 - r.vertex1;
-            Vector b = r.vertex3 - r.vertex1;
-            Vector n = cross(a, b);
-            if (n.length() == 0.0f)
-                continue;
-            n /= n.length();
-            unsigned int i1 = get_index(r.vertex1, n);
-            unsigned int i2 = get_index(r.vertex2, n);
-            unsigned int i3 = get_index(r.vertex3, n);
-            triangles.push_back(i1);
-            triangles.push_back(i2);
-            triangles.push_back(i3);
+            if (e < 100000)
+                e = e * 10 + (*p - '0');
         }
-        return true;
+        exponent += negative_exponent ? -e : e;
     }
+    if (p != end)
+        return parse_real_slow(token, length, f);
 
-    Box model_box()
+    if (mantissa == 0)
     {
-        if (box_cached)
-            return box;
-        box_cached = true;
-        if (vertices.empty())
-        {
-            box = Box{ 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
-            return box;
+        *f = negative ? -0.0f : 0.0f;
+        return true;
+    }
+    if (truncated || mantissa > (1ull << 53) || exponent < -22 || exponent > 22)
+        return parse_real_slow(token, length, f);
+
+    double d = (double)mantissa;
+    if (exponent < 0)
+        d /= powers[-exponent];
+    else
+        d *= powers[exponent];
+    if (d > FLT_MAX)
+        return false;
+    if (d < FLT_MIN)
+        return parse_real_slow(token, length, f);
+
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    if ((bits & 0x1fffffff) == 0x10000000)
+        return parse_real_slow(token, length, f);
+
+    *f = negative ? -(float)d : (float)d;
+    return true;
+}
+
+static inline uint64_t float_key(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits == 0x80000000u ? 0 : bits; // -0 == 0 so they must hash alike
+}
+
+// Mixes all six coordinates so swapped or mirrored coordinates land far apart
+struct Hasher
+{
+    uint64_t operator() (const VertexRecord &r) const
+    {
+        uint64_t a = float_key(r.point.x) | (float_key(r.point.y) << 32);
+        uint64_t b = float_key(r.point.z) | (float_key(r.normal.x) << 32);
+        uint64_t c = float_key(r.normal.y) | (float_key(r.normal.z) << 32);
+        uint64_t h = a * 0x9e3779b97f4a7c15ull ^ b * 0xc2b2ae3d27d4eb4full ^ c * 0x165667b19e3779f9ull;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+};
+
+// Open addressing map from VertexRecord to vertex index with linear probing.
+// Each slot holds the key next to its value so a lookup usually touches a single cache line.
+struct VertexMap
+{
+    struct Slot
+    {
+        VertexRecord key;
+        unsigned int value;
+    };
+
+    static const unsigned int empty = ~0u;
+
+    std::vector<Slot> slots;
+    size_t count = 0;
+    size_t mask = 0;
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    void clear()
+    {
+        for (auto &slot : slots)
+            slot.value = empty;
+        count = 0;
+    }
+
+    // Clears and gives the memory back
+    void release()
+    {
+        std::vector<Slot>().swap(slots);
+        count = 0;
+        mask = 0;
+    }
+
+    // Sizes the table so n entries fit without growing
+    void reserve(size_t n)
+    {
+        size_t capacity = 16;
+        while (capacity * 7 < n * 10)
+            capacity *= 2;
+        if (capacity > slots.size())
+            rehash(capacity);
+    }
+
+    // Returns the value stored for key, first storing value if the key is new
+    unsigned int insert(const VertexRecord &key, unsigned int value, bool &inserted)
+    {
+        if ((count + 1) * 10 > slots.size() * 7)
+            rehash(slots.empty() ? 16 : slots.size() * 2);
+
+        for (size_t i = Hasher()(key) & mask; ; i = (i + 1) & mask)
+        {
+            Slot &slot = slots[i];
+            if (slot.value == empty)
+            {
+                slot.key = key;
+                slot.value = value;
+                ++count;
+                inserted = true;
+                return value;
+            }
+            if (slot.key == key)
+            {
+                inserted = false;
+                return slot.value;
+            }
+        }
+    }
+
+    void rehash(size_t capacity)
+    {
+        std::vector<Slot> old;
+        old.swap(slots);
+        slots.resize(capacity);
+        mask = capacity - 1;
+        for (auto &slot : slots)
+            slot.value = empty;
+        for (const auto &slot : old)
+        {
+            if (slot.value == empty)
+                continue;
+            size_t i = Hasher()(slot.key) & mask;
+            while (slots[i].value != empty)
+                i = (i + 1) & mask;
+            slots[i] = slot;
+        }
+    }
+};
+
+// Sum of squared distances to a set of weighted planes, stored as the upper half of the 4x4 matrix
+struct Quadric
+{
+    double a2 = 0, ab = 0, ac = 0, ad = 0, b2 = 0, bc = 0, bd = 0, c2 = 0, cd = 0, d2 = 0;
+    double weight = 0;
+
+    void add_plane(const Vector &n, double d, double w)
+    {
+        a2 += w * n.x * n.x; ab += w * n.x * n.y; ac += w * n.x * n.z; ad += w * n.x * d;
+        b2 += w * n.y * n.y; bc += w * n.y * n.z; bd += w * n.y * d;
+        c2 += w * n.z * n.z; cd += w * n.z * d;
+        d2 += w * d * d;
+        weight += w;
+    }
+
+    Quadric &operator += (const Quadric &o)
+    {
+        a2 += o.a2; ab += o.ab; ac += o.ac; ad += o.ad;
+        b2 += o.b2; bc += o.bc; bd += o.bd;
+        c2 += o.c2; cd += o.cd;
+        d2 += o.d2;
+        weight += o.weight;
+        return *this;
+    }
+
+    // Mean squared distance of p from the planes
+    double error(const Vector &p) const
+    {
+        double x = p.x, y = p.y, z = p.z;
+        double e = a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+            + b2 * y * y + 2 * bc * y * z + 2 * bd * y
+            + c2 * z * z + 2 * cd * z + d2;
+        return weight > 0 ? (std::max)(e, 0.0) / weight : 0.0;
+    }
+
+    // The point of least error, if the planes pin one down
+    bool optimum(Vector &p) const
+    {
+        double det = a2 * (b2 * c2 - bc * bc) - ab * (ab * c2 - bc * ac) + ac * (ab * bc - b2 * ac);
+        double trace = (a2 + b2 + c2) / 3;
+        if (fabs(det) <= 1e-6 * trace * trace * trace)
+            return false;
+        p.x = (float)(-(ad * (b2 * c2 - bc * bc) - ab * (bd * c2 - bc * cd) + ac * (bd * bc - b2 * cd)) / det);
+        p.y = (float)(-(a2 * (bd * c2 - cd * bc) - ad * (ab * c2 - bc * ac) + ac * (ab * cd - bd * ac)) / det);
+        p.z = (float)(-(a2 * (b2 * cd - bc * bd) - ab * (ab * cd - bd * ac) + ad * (ab * bc - b2 * ac)) / det);
+        return true;
+    }
+};
+
+// Garland and Heckbert edge collapse. Triangles are joined through shared points, whatever the
+// vertex normals, and each point starts with the area weighted planes of its triangles plus planes
+// standing on boundary edges so open borders keep their shape. Edges come off a heap cheapest first;
+// entries are stamped with their points' collapse counts so ones made stale by a neighbouring
+// collapse are skipped. A collapse is refused if it would fold a triangle over or pinch the surface
+// into a non manifold edge. error is the worst root mean squared plane distance collapsed so far.
+struct Simplifier
+{
+    static const unsigned int none = ~0u;
+
+    struct Collapse
+    {
+        float cost;
+        unsigned int a, b;
+        unsigned int stamp_a, stamp_b;
+        bool operator < (const Collapse &other) const
+        {
+            return cost > other.cost;
+        }
+    };
+
+    std::vector<Vector> points;
+    std::vector<Quadric> quadrics;
+    std::vector<unsigned int> stamp;
+    std::vector<unsigned int> mark;
+    unsigned int mark_generation = 0;
+    std::vector<unsigned int> corners;      // point at each triangle corner
+    std::vector<unsigned int> next_corner;  // next corner at the same point
+    std::vector<unsigned int> first_corner; // per point, none if it has gone
+    std::vector<unsigned char> face_dead;
+    size_t live_faces = 0;
+    double max_cost = 0;
+    std::priority_queue<Collapse> heap;
+
+    // point_of gives each vertex's point number, n_points of them
+    void build(const std::vector<Vector> &vertices, const std::vector<unsigned int> &triangles, const std::vector<unsigned int> &point_of, size_t n_points)
+    {
+        size_t n = triangles.size();
+        points.resize(n_points);
+        for (size_t v = 0; v < vertices.size(); ++v)
+            points[point_of[v]] = vertices[v];
+        quadrics.resize(n_points);
+        stamp.assign(n_points, 0);
+        mark.assign(n_points, 0);
+        corners.resize(n);
+        next_corner.resize(n);
+        first_corner.assign(n_points, (unsigned int)none);
+        face_dead.assign(n / 3, 0);
+
+        std::vector<uint64_t> keys;
+        std::vector<unsigned int> sides;
+        for (size_t f = 0; f < n / 3; ++f)
+        {
+            unsigned int *t = &corners[f * 3];
+            for (int e = 0; e < 3; ++e)
+                t[e] = point_of[triangles[f * 3 + e]];
+            if (t[0] == t[1] || t[1] == t[2] || t[2] == t[0])
+            {
+                face_dead[f] = 1;
+                continue;
+            }
+            ++live_faces;
+
+            Vector normal = cross(points[t[1]] - points[t[0]], points[t[2]] - points[t[0]]);
+            float length = normal.length();
+            for (int e = 0; e < 3; ++e)
+            {
+                unsigned int k = (unsigned int)(f * 3 + e);
+                next_corner[k] = first_corner[t[e]];
+                first_corner[t[e]] = k;
+                if (length > 0.0f)
+                    quadrics[t[e]].add_plane(normal / length, -dot(normal / length, points[t[0]]), length / 2);
+                unsigned int a = t[e], b = t[e == 2 ? 0 : e + 1];
+                keys.push_back(a < b ? ((uint64_t)a << 32) | b : ((uint64_t)b << 32) | a);
+                sides.push_back(k);
+            }
+        }
+
+        radix_sort(keys, sides);
+        for (size_t begin = 0; begin < keys.size(); )
+        {
+            size_t end = begin + 1;
+            while (end < keys.size() && keys[end] == keys[begin])
+                ++end;
+            if (end - begin == 1)
+                add_boundary(sides[begin]);
+            begin = end;
+        }
+        keys = std::vector<uint64_t>();
+
+        for (unsigned int k : sides)
+        {
+            unsigned int a = corners[k], b = corners[k % 3 == 2 ? k - 2 : k + 1];
+            if (a < b)
+                push(a, b);
+        }
+    }
+
+    // A plane through the side starting at corner k, square to its triangle
+    void add_boundary(unsigned int k)
+    {
+        unsigned int f = k / 3;
+        unsigned int a = corners[k], b = corners[k % 3 == 2 ? k - 2 : k + 1];
+        Vector normal = cross(points[corners[f * 3 + 1]] - points[corners[f * 3]], points[corners[f * 3 + 2]] - points[corners[f * 3]]);
+        Vector side = points[b] - points[a];
+        Vector across = cross(side, normal);
+        float length = across.length();
+        if (length == 0.0f)
+            return;
+        across /= length;
+        double w = dot(side, side);
+        quadrics[a].add_plane(across, -dot(across, points[a]), w);
+        quadrics[b].add_plane(across, -dot(across, points[a]), w);
+    }
+
+    // Calls fn with each corner at point p whose triangle is still there, unlinking the others
+    template <typename Fn>
+    void for_each_corner(unsigned int p, Fn fn)
+    {
+        unsigned int *link = &first_corner[p];
+        while (*link != none)
+        {
+            unsigned int k = *link;
+            if (face_dead[k / 3])
+            {
+                *link = next_corner[k];
+                continue;
+            }
+            fn(k);
+            link = &next_corner[k];
+        }
+    }
+
+    // Where a and b would merge to: the quadric optimum if there is one, else the best of the ends and middle
+    double target(unsigned int a, unsigned int b, Vector &p)
+    {
+        Quadric q = quadrics[a];
+        q += quadrics[b];
+        Vector choices[4] = { points[a], points[b], (points[a] + points[b]) / 2.0f, points[a] };
+        int n_choices = q.optimum(choices[3]) ? 4 : 3;
+        double best = -1;
+        for (int i = 0; i < n_choices; ++i)
+        {
+            double e = q.error(choices[i]);
+            if (best < 0 || e < best)
+            {
+                best = e;
+                p = choices[i];
+            }
+        }
+        return best;
+    }
+
+    void push(unsigned int a, unsigned int b)
+    {
+        Vector p;
+        double cost = target(a, b, p);
+        heap.push(Collapse{ (float)cost, a, b, stamp[a], stamp[b] });
+    }
+
+    bool face_has(unsigned int f, unsigned int p) const
+    {
+        return corners[f * 3] == p || corners[f * 3 + 1] == p || corners[f * 3 + 2] == p;
+    }
+
+    // Refuses collapses that flip a triangle or join two sheets: a and b may only share the
+    // neighbours on the triangles along their edge
+    bool can_collapse(unsigned int a, unsigned int b, const Vector &p)
+    {
+        unsigned int ga = ++mark_generation;
+        unsigned int gb = ++mark_generation;
+        int shared_faces = 0;
+        for_each_corner(a, [&](unsigned int k)
+        {
+            unsigned int f = k / 3;
+            if (face_has(f, b))
+                ++shared_faces;
+            for (int e = 0; e < 3; ++e)
+                mark[corners[f * 3 + e]] = ga;
+        });
+        int shared_points = 0;
+        bool ok = true;
+        for_each_corner(b, [&](unsigned int k)
+        {
+            unsigned int f = k / 3;
+            for (int e = 0; e < 3; ++e)
+            {
+                unsigned int q = corners[f * 3 + e];
+                if (q != a && q != b && mark[q] == ga)
+                {
+                    ++shared_points;
+                    mark[q] = gb;
+                }
+            }
+        });
+        if (shared_points != shared_faces)
+            return false;
+
+        auto check = [&](unsigned int moving, unsigned int other)
+        {
+            for_each_corner(moving, [&](unsigned int k)
+            {
+                unsigned int f = k / 3;
+                if (!ok || face_has(f, other))
+                    return;
+                Vector v[3], w[3];
+                for (int e = 0; e < 3; ++e)
+                {
+                    v[e] = points[corners[f * 3 + e]];
+                    w[e] = corners[f * 3 + e] == moving ? p : v[e];
+                }
+                Vector before = cross(v[1] - v[0], v[2] - v[0]);
+                Vector after = cross(w[1] - w[0], w[2] - w[0]);
+                if (dot(before, after) <= 0.0f)
+                    ok = false;
+            });
+        };
+        check(a, b);
+        check(b, a);
+        return ok;
+    }
+
+    // Moves a to p and hands it b's triangles, dropping the ones on the edge between them
+    void collapse(unsigned int a, unsigned int b, const Vector &p)
+    {
+        points[a] = p;
+        quadrics[a] += quadrics[b];
+        ++stamp[a];
+        ++stamp[b];
+
+        unsigned int *link = &first_corner[b];
+        while (*link != none)
+        {
+            unsigned int k = *link;
+            unsigned int f = k / 3;
+            if (!face_dead[f] && face_has(f, a))
+            {
+                face_dead[f] = 1;
+                --live_faces;
+            }
+            if (face_dead[f])
+            {
+                *link = next_corner[k];
+                continue;
+            }
+            corners[k] = a;
+            link = &next_corner[k];
+        }
+        *link = first_corner[a];
+        first_corner[a] = first_corner[b];
+        first_corner[b] = none;
+
+        unsigned int g = ++mark_generation;
+        mark[a] = g;
+        for_each_corner(a, [&](unsigned int k)
+        {
+            unsigned int f = k / 3;
+            for (int e = 0; e < 3; ++e)
+            {
+                unsigned int q = corners[f * 3 + e];
+                if (mark[q] != g)
+                {
+                    mark[q] = g;
+                    push(a, q);
+                }
+            }
+        });
+    }
+
+    // Collapses edges until no more than target_faces triangles are left, nothing more can go or
+    // cancelled is set
+    void simplify(size_t target_faces, const std::atomic<bool> &cancelled)
+    {
+        size_t steps = 0;
+        while (live_faces > target_faces && !heap.empty())
+        {
+            if ((++steps & 4095) == 0 && cancelled)
+                return;
+            Collapse c = heap.top();
+            heap.pop();
+            if (first_corner[c.a] == none || first_corner[c.b] == none || stamp[c.a] != c.stamp_a || stamp[c.b] != c.stamp_b)
+                continue;
+            Vector p;
+            target(c.a, c.b, p);
+            if (!can_collapse(c.a, c.b, p))
+                continue;
+            collapse(c.a, c.b, p);
+            max_cost = (std::max)(max_cost, (double)c.cost);
+        }
+    }
+
+    float error() const
+    {
+        return (float)sqrt(max_cost);
+    }
+
+    // The triangles left, over just the points they use
+    void extract(std::vector<Vector> &out_vertices, std::vector<unsigned int> &out_triangles) const
+    {
+        std::vector<unsigned int> number(points.size(), (unsigned int)none);
+        out_vertices.clear();
+        out_triangles.clear();
+        for (size_t k = 0; k < corners.size(); ++k)
+        {
+            if (face_dead[k / 3])
+                continue;
+            unsigned int p = corners[k];
+            if (number[p] == none)
+            {
+                number[p] = (unsigned int)out_vertices.size();
+                out_vertices.push_back(points[p]);
+            }
+            out_triangles.push_back(number[p]);
+        }
+    }
+};
+
+// Spreads the low 10 bits of v out to every third bit
+static inline uint32_t morton_spread(uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// A run of triangles close together in space, with a sphere holding them and a cone holding their
+// facet normals: every normal is within the cone's angle of axis, and cutoff is the sine of that
+// angle, or 2 when the normals spread too far for the cone to rule anything out
+struct Cluster
+{
+    Vector center;
+    float radius;
+    Vector axis;
+    float cutoff;
+    unsigned int first;     // first index in the triangle list
+    unsigned int count;     // indices
+};
+
+// Node of a bounding volume hierarchy over the triangles of a mesh, stored depth first so an inner
+// node's first child comes straight after it
+struct BvhNode
+{
+    float min[3];
+    unsigned int first;     // first of a leaf's packs in bvh_packs, or an inner node's second child
+    float max[3];
+    unsigned int count;     // triangles in a leaf, 0 for an inner node
+};
+
+// Builds a hierarchy with the surface area heuristic, choosing splits among bins of the triangle
+// centroids on each axis. Subtrees over many triangles are built on other threads into their own
+// arrays and appended. Once cancelled is set the rest of the tree is left out.
+struct BvhBuilder
+{
+    static const int bins = 12;
+    static const unsigned int leaf_size = 4;        // always a leaf at this size or below
+    static const unsigned int max_leaf_size = 16;   // never a leaf above this size
+    static const unsigned int parallel_size = 65536;
+
+    const Box *bounds;          // of each triangle
+    const Vector *centroids;
+    unsigned int *faces;
+    const std::atomic<bool> &cancelled;
+
+    // Appends the subtree over faces[first, first + count) to nodes. Up to depth more levels may
+    // hand one of their subtrees to another thread.
+    void build(std::vector<BvhNode> &nodes, unsigned int first, unsigned int count, int depth) const
+    {
+        if (cancelled)
+            return;
+        const Box empty = { FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX };
+        Box b = empty, cb = empty;
+        for (unsigned int i = first; i < first + count; ++i)
+        {
+            b += bounds[faces[i]];
+            const Vector &c = centroids[faces[i]];
+            cb += Box{ c.x, c.x, c.y, c.y, c.z, c.z };
+        }
+        size_t index = nodes.size();
+        nodes.push_back(BvhNode{ { b.xmin, b.ymin, b.zmin }, first, { b.xmax, b.ymax, b.zmax }, count });
+        if (count <= leaf_size)
+            return;
+
+        // Cost of a split relative to testing every triangle here, with a node visit as one test
+        float cb_min[3] = { cb.xmin, cb.ymin, cb.zmin };
+        float cb_extent[3] = { cb.xmax - cb.xmin, cb.ymax - cb.ymin, cb.zmax - cb.zmin };
+        int best_axis = -1, best_split = 0;
+        float best_cost = (float)count;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (cb_extent[axis] <= 0.0f)
+                continue;
+            Box bin_box[bins];
+            unsigned int bin_count[bins] = {};
+            for (int k = 0; k < bins; ++k)
+                bin_box[k] = empty;
+            float to_bin = bins / cb_extent[axis];
+            for (unsigned int i = first; i < first + count; ++i)
+            {
+                int k = (std::min)(bins - 1, (int)(((&centroids[faces[i]].x)[axis] - cb_min[axis]) * to_bin));
+                ++bin_count[k];
+                bin_box[k] += bounds[faces[i]];
+            }
+            float right_area[bins];
+            Box right = empty;
+            unsigned int right_count = 0;
+            for (int k = bins - 1; k > 0; --k)
+            {
+                right += bin_box[k];
+                right_count += bin_count[k];
+                right_area[k] = right_count ? right.area() * right_count : 0.0f;
+            }
+            Box left = empty;
+            unsigned int left_count = 0;
+            for (int k = 1; k < bins; ++k)
+            {
+                left += bin_box[k - 1];
+                left_count += bin_count[k - 1];
+                if (left_count == 0 || left_count == count)
+                    continue;
+                float cost = 1.0f + (left.area() * left_count + right_area[k]) / b.area();
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = k;
+                }
+            }
+        }
+
+        unsigned int mid;
+        if (best_axis >= 0)
+        {
+            float to_bin = bins / cb_extent[best_axis];
+            float bin_min = cb_min[best_axis];
+            mid = (unsigned int)(std::partition(faces + first, faces + first + count, [&](unsigned int f)
+            {
+                return (std::min)(bins - 1, (int)(((&centroids[f].x)[best_axis] - bin_min) * to_bin)) < best_split;
+            }) - (faces + first));
+        }
+        else if (count <= max_leaf_size)
+            return;
+        else
+            mid = count / 2;    // centroids all alike, any split will do
+
+        nodes[index].count = 0;
+        if (depth > 0 && count > parallel_size)
+        {
+            std::vector<BvhNode> right;
+            auto task = std::async(std::launch::async, [&]() { build(right, first + mid, count - mid, depth - 1); });
+            build(nodes, first, mid, depth - 1);
+            task.get();
+            unsigned int offset = (unsigned int)nodes.size();
+            nodes[index].first = offset;
+            for (BvhNode &n : right)
+            {
+                if (n.count == 0)
+                    n.first += offset;
+                nodes.push_back(n);
+            }
+        }
+        else
+        {
+            build(nodes, first, mid, depth);
+            nodes[index].first = (unsigned int)nodes.size();
+            build(nodes, first + mid, count - mid, depth);
+        }
+    }
+};
+
+// Builds a k-d tree over points in the same node layout as the picking hierarchy, leaves holding
+// the points themselves. Each node is split at the median along its longest side. Once cancelled
+// is set the rest of the tree is left out.
+struct KdBuilder
+{
+    static const unsigned int leaf_size = 16;
+    static const unsigned int parallel_size = 65536;
+
+    Vector *points;
+    const std::atomic<bool> &cancelled;
+
+    void build(std::vector<BvhNode> &nodes, unsigned int first, unsigned int count, int depth) const
+    {
+        if (cancelled)
+            return;
+        Box b = { FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX };
+        for (unsigned int i = first; i < first + count; ++i)
+        {
+            const Vector &p = points[i];
+            b += Box{ p.x, p.x, p.y, p.y, p.z, p.z };
+        }
+        size_t index = nodes.size();
+        nodes.push_back(BvhNode{ { b.xmin, b.ymin, b.zmin }, first, { b.xmax, b.ymax, b.zmax }, count });
+        if (count <= leaf_size)
+            return;
+
+        float extent[3] = { b.xmax - b.xmin, b.ymax - b.ymin, b.zmax - b.zmin };
+        int axis = extent[0] >= extent[1] && extent[0] >= extent[2] ? 0 : extent[1] >= extent[2] ? 1 : 2;
+        unsigned int mid = count / 2;
+        std::nth_element(points + first, points + first + mid, points + first + count, [axis](const Vector &p, const Vector &q)
+        {
+            return (&p.x)[axis] < (&q.x)[axis];
+        });
+
+        nodes[index].count = 0;
+        if (depth > 0 && count > parallel_size)
+        {
+            std::vector<BvhNode> right;
+            auto task = std::async(std::launch::async, [&]() { build(right, first + mid, count - mid, depth - 1); });
+            build(nodes, first, mid, depth - 1);
+            task.get();
+            unsigned int offset = (unsigned int)nodes.size();
+            nodes[index].first = offset;
+            for (BvhNode &n : right)
+            {
+                if (n.count == 0)
+                    n.first += offset;
+                nodes.push_back(n);
+            }
+        }
+        else
+        {
+            build(nodes, first, mid, depth);
+            nodes[index].first = (unsigned int)nodes.size();
+            build(nodes, first + mid, count - mid, depth);
+        }
+    }
+};
+
+// Distance along the ray, in lengths of its direction, where it enters the node's box, if it does
+// so before t_max. inverse holds the reciprocals of the direction.
+static bool ray_enters(const BvhNode &node, const Ray &ray, const Vector &inverse, float t_max, float &entry)
+{
+    float t0 = (node.min[0] - ray.pt.x) * inverse.x, t1 = (node.max[0] - ray.pt.x) * inverse.x;
+    float near_t = (std::min)(t0, t1), far_t = (std::max)(t0, t1);
+    t0 = (node.min[1] - ray.pt.y) * inverse.y;
+    t1 = (node.max[1] - ray.pt.y) * inverse.y;
+    near_t = (std::max)(near_t, (std::min)(t0, t1));
+    far_t = (std::min)(far_t, (std::max)(t0, t1));
+    t0 = (node.min[2] - ray.pt.z) * inverse.z;
+    t1 = (node.max[2] - ray.pt.z) * inverse.z;
+    near_t = (std::max)(near_t, (std::min)(t0, t1));
+    far_t = (std::min)(far_t, (std::max)(t0, t1));
+    entry = near_t;
+    return near_t <= far_t && far_t >= 0.0f && near_t <= t_max;
+}
+
+// Four triangles laid out lane by lane for the ray test: the first corner and the two sides leaving
+// it, x, y and z apart. Unused lanes have zero sides, which no ray can hit. Lanes are read with
+// unaligned loads since vector storage need not honour the alignment before C++17.
+struct alignas(16) TrianglePack
+{
+    float corner[3][4];
+    float side1[3][4];
+    float side2[3][4];
+    unsigned int face[4];   // triangle number in the mesh
+};
+
+// The nearest place a ray meets a mesh: the distance in lengths of the ray direction, and the
+// weights of the second and third corners of the triangle there
+struct RayHit
+{
+    float t = FLT_MAX;
+    float u = 0.0f;
+    float v = 0.0f;
+    unsigned int face = 0;
+};
+
+static void pack_triangles(TrianglePack &pack, const Vector *vertices, const unsigned int *triangles, const unsigned int *faces, unsigned int count)
+{
+    memset(&pack, 0, sizeof(pack));
+    for (unsigned int k = 0; k < count; ++k)
+    {
+        const unsigned int *tri = &triangles[faces[k] * 3];
+        const Vector &a = vertices[tri[0]];
+        Vector side1 = vertices[tri[1]] - a;
+        Vector side2 = vertices[tri[2]] - a;
+        pack.corner[0][k] = a.x;
+        pack.corner[1][k] = a.y;
+        pack.corner[2][k] = a.z;
+        pack.side1[0][k] = side1.x;
+        pack.side1[1][k] = side1.y;
+        pack.side1[2][k] = side1.z;
+        pack.side2[0][k] = side2.x;
+        pack.side2[1][k] = side2.y;
+        pack.side2[2][k] = side2.z;
+        pack.face[k] = faces[k];
+    }
+}
+
+// Moller-Trumbore test of the ray against count packs, keeping the nearest hit in front of the ray
+// that is nearer than hit.t. Points on the sides of a triangle count as inside it.
+static bool ray_hits_packs(const Ray &ray, const TrianglePack *packs, size_t count, RayHit &hit)
+{
+    bool found = false;
+#if HAVE_SSE2
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z);
+    const __m128 ox = _mm_set1_ps(ray.pt.x), oy = _mm_set1_ps(ray.pt.y), oz = _mm_set1_ps(ray.pt.z);
+    __m128 nearest = _mm_set1_ps(hit.t);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const TrianglePack &p = packs[i];
+        __m128 e1x = _mm_loadu_ps(p.side1[0]), e1y = _mm_loadu_ps(p.side1[1]), e1z = _mm_loadu_ps(p.side1[2]);
+        __m128 e2x = _mm_loadu_ps(p.side2[0]), e2y = _mm_loadu_ps(p.side2[1]), e2z = _mm_loadu_ps(p.side2[2]);
+
+        // p = dir x side2, det = side1 . p
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        __m128 inv = _mm_div_ps(one, det);
+
+        // s = origin - corner, u = s . p / det
+        __m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(p.corner[0]));
+        __m128 sy = _mm_sub_ps(oy, _mm_loadu_ps(p.corner[1]));
+        __m128 sz = _mm_sub_ps(oz, _mm_loadu_ps(p.corner[2]));
+        __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv);
+
+        // q = s x side1, v = dir . q / det, t = side2 . q / det
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+
+        // Lanes with no area give NaNs here, which fail every test
+        __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)),
+                                   _mm_cmple_ps(_mm_add_ps(u, v), one));
+        __m128 ahead = _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmplt_ps(t, nearest));
+        int mask = _mm_movemask_ps(_mm_and_ps(_mm_and_ps(inside, ahead), _mm_cmpneq_ps(det, zero)));
+        if (mask == 0)
+            continue;
+
+        alignas(16) float ts[4], us[4], vs[4];
+        _mm_store_ps(ts, t);
+        _mm_store_ps(us, u);
+        _mm_store_ps(vs, v);
+        for (int k = 0; k < 4; ++k)
+        {
+            if ((mask & (1 << k)) != 0 && ts[k] < hit.t)
+            {
+                hit.t = ts[k];
+                hit.u = us[k];
+                hit.v = vs[k];
+                hit.face = p.face[k];
+                found = true;
+            }
+        }
+        nearest = _mm_set1_ps(hit.t);
+    }
+#else
+    for (size_t i = 0; i < count; ++i)
+    {
+        const TrianglePack &p = packs[i];
+        for (int k = 0; k < 4; ++k)
+        {
+            Vector side1 = { p.side1[0][k], p.side1[1][k], p.side1[2][k] };
+            Vector side2 = { p.side2[0][k], p.side2[1][k], p.side2[2][k] };
+            Vector pv = cross(ray.dir, side2);
+            float det = dot(side1, pv);
+            if (det == 0.0f)
+                continue;
+            float inv = 1.0f / det;
+            Vector s = ray.pt - Vector{ p.corner[0][k], p.corner[1][k], p.corner[2][k] };
+            float u = dot(s, pv) * inv;
+            if (!(u >= 0.0f && u <= 1.0f))
+                continue;
+            Vector q = cross(s, side1);
+            float v = dot(ray.dir, q) * inv;
+            if (!(v >= 0.0f && u + v <= 1.0f))
+                continue;
+            float t = dot(side2, q) * inv;
+            if (t >= 0.0f && t < hit.t)
+            {
+                hit.t = t;
+                hit.u = u;
+                hit.v = v;
+                hit.face = p.face[k];
+                found = true;
+            }
+        }
+    }
+#endif
+    return found;
+}
+
+// What the camera can see, in model coordinates: the six frustum planes, facing inwards, and the
+// eye point, or for a parallel projection the direction of view
+struct ViewVolume
+{
+    float planes[6][4];
+    Vector eye;
+    Vector direction;
+    mat4x4 projection;
+    mat4x4 modelview;
+    bool perspective = true;
+    bool cull = false;
+
+    void set(mat4x4 projection_matrix, mat4x4 modelview_matrix, bool is_perspective)
+    {
+        mat4x4_dup(projection, projection_matrix);
+        mat4x4_dup(modelview, modelview_matrix);
+        mat4x4 m;
+        mat4x4_mul(m, projection, modelview);
+        for (int p = 0; p < 6; ++p)
+        {
+            int axis = p / 2;
+            float sign = (p & 1) ? -1.0f : 1.0f;
+            float length = 0.0f;
+            for (int i = 0; i < 4; ++i)
+            {
+                planes[p][i] = m[i][3] + sign * m[i][axis];
+                if (i < 3)
+                    length += planes[p][i] * planes[p][i];
+            }
+            length = sqrtf(length);
+            for (int i = 0; i < 4 && length > 0.0f; ++i)
+                planes[p][i] /= length;
+        }
+
+        mat4x4 inverse;
+        mat4x4_invert(inverse, modelview);
+        eye = { inverse[3][0], inverse[3][1], inverse[3][2] };
+        direction = { -inverse[2][0], -inverse[2][1], -inverse[2][2] };
+        direction.normalize();
+        perspective = is_perspective;
+    }
+
+    // The same volume in the coordinates of a mesh placed by transform
+    ViewVolume placed(mat4x4 transform) const
+    {
+        ViewVolume v;
+        mat4x4 p, m;
+        mat4x4_dup(p, (vec4 *)projection);
+        mat4x4_mul(m, (vec4 *)modelview, transform);
+        v.set(p, m, perspective);
+        v.cull = cull;
+        return v;
+    }
+
+    bool in_frustum(const Vector &center, float radius) const
+    {
+        for (int p = 0; p < 6; ++p)
+        {
+            if (planes[p][0] * center.x + planes[p][1] * center.y + planes[p][2] * center.z + planes[p][3] < -radius)
+                return false;
+        }
+        return true;
+    }
+
+    // False if the cluster is outside the frustum or, when faces pointing away are hidden, every
+    // triangle in it faces away from the eye
+    bool sees(const Cluster &c, bool backfaces_hidden) const
+    {
+        if (!in_frustum(c.center, c.radius))
+            return false;
+        if (!backfaces_hidden)
+            return true;
+        if (perspective)
+        {
+            Vector d = c.center - eye;
+            return dot(d, c.axis) < c.cutoff * d.length() + c.radius;
+        }
+        return dot(direction, c.axis) < c.cutoff;
+    }
+};
+
+struct Color
+{
+    float r, g, b;
+};
+
+// One placement of a mesh: a rigid transform, possibly scaled evenly, and a color
+struct Instance
+{
+    mat4x4 transform;
+    Color color;
+};
+
+// Longest axis of a transform, so a sphere of radius r placed by it fits in one of r times this
+static float transform_scale(mat4x4 t)
+{
+    float s = 0.0f;
+    for (int i = 0; i < 3; ++i)
+        s = (std::max)(s, sqrtf(t[i][0] * t[i][0] + t[i][1] * t[i][1] + t[i][2] * t[i][2]));
+    return s;
+}
+
+static Vector transform_point(mat4x4 t, const Vector &p)
+{
+    vec4 in = { p.x, p.y, p.z, 1.0f };
+    vec4 out;
+    mat4x4_mul_vec4(out, t, in);
+    return Vector{ out[0], out[1], out[2] };
+}
+
+static Vector transform_direction(mat4x4 t, const Vector &d)
+{
+    vec4 in = { d.x, d.y, d.z, 0.0f };
+    vec4 out;
+    mat4x4_mul_vec4(out, t, in);
+    return Vector{ out[0], out[1], out[2] };
+}
+
+// Texture unit the mesh program reads instances from
+static const GLint instance_unit = 1;
+
+// Attribute locations fixed by the layout qualifiers in the mesh vertex shader
+static const GLuint position_attribute = 0;
+static const GLuint normal_attribute = 1;
+
+struct Mesh
+{
+    std::vector<Vector> vertices;
+    std::vector<Vector> normals;
+    typedef VertexMap IndexMap;
+    IndexMap indices;
+    std::vector<unsigned int> triangles;
+    std::vector<unsigned int> edges;
+    std::vector<Cluster> clusters;
+    std::atomic<bool> solid{ false };   // closed and wound outwards, so faces pointing away are hidden
+    Vector center;
+    Color color;
+    Box box;
+
+    // Copies of the mesh drawn elsewhere and in other colors. With none the mesh is drawn once as it
+    // stands, in color.
+    std::vector<Instance> instances;
+    bool box_cached = false;
+    bool include_in_scene_box = true;
+
+    // Set while clear or the destructor waits for the background tasks, so the simplifier and the
+    // picking tree builds give up early
+    std::atomic<bool> tasks_cancelled{ false };
+
+    // Edges are only needed for wireframe so they are built in the background once the mesh is shown
+    std::atomic<bool> edges_ready{ false };
+    std::future<void> edges_task;
+
+    // Boundary, non manifold and crease edges only, built on demand for the feature edge view
+    std::vector<unsigned int> feature_edges;
+    std::atomic<bool> feature_edges_ready{ false };
+    std::future<void> feature_edges_task;
+
+    // Simplified copies, finest first, built in the background for big meshes. A level's lod_error
+    // bounds how far it strays from the full mesh, in model units.
+    std::vector<std::unique_ptr<Mesh>> lods;
+    std::atomic<bool> lods_ready{ false };
+    std::future<void> lods_task;
+    float lod_error = 0.0f;
+    Mesh *drawn_level = nullptr;    // this mesh or one of its lods, whichever render drew last
+
+    // Hierarchy for picking, made the first time the mesh is picked, or in the background once
+    // hover picking wants it
+    std::vector<BvhNode> bvh;
+    std::vector<TrianglePack> bvh_packs;   // each leaf's triangles, four to a pack
+    std::atomic<bool> bvh_ready{ false };
+    std::future<void> bvh_task;
+
+    // Vertex positions in a k-d tree for snapping picks to vertices, made the same way
+    std::vector<BvhNode> point_tree;
+    std::vector<Vector> point_tree_points;  // in leaf order
+    std::atomic<bool> point_tree_ready{ false };
+    std::future<void> point_tree_task;
+
+    // Buffer objects holding the mesh on the GPU, filled on first render and again after the mesh changes
+    GLuint vao = 0;
+    GLuint vertex_buffer = 0;
+    GLuint triangle_buffer = 0;
+    GLuint edge_buffer = 0;
+    GLuint feature_edge_buffer = 0;
+    GLuint sample_buffer = 0;   // every vertex number in random order, any prefix is an even point sample
+    GLuint instance_buffer = 0; // transform columns then color for each instance drawn, read as a texture
+    GLuint instance_texture = 0;
+    bool gpu_dirty = true;
+    bool edges_uploaded = false;
+    bool feature_edges_uploaded = false;
+    bool samples_uploaded = false;
+
+    // Index runs for the clusters that survive culling and the instances in view, kept to save
+    // allocating every frame
+    std::vector<GLsizei> run_counts;
+    std::vector<const void *> run_offsets;
+    std::vector<float> instance_data;
+
+    Mesh()
+    {
+        color.r = 0.8f;
+        color.g = 0.7f;
+        color.b = 0.6f;
+    }
+
+    ~Mesh()
+    {
+        tasks_cancelled = true;
+        wait_for_tasks();
+        release_gpu();
+    }
+
+    void release_gpu()
+    {
+        if (vao == 0)
+            return;
+        GLuint buffers[] = { vertex_buffer, triangle_buffer, edge_buffer, feature_edge_buffer, sample_buffer, instance_buffer };
+        glDeleteBuffers(6, buffers);
+        glDeleteTextures(1, &instance_texture);
+        glDeleteVertexArrays(1, &vao);
+        vao = 0;
+    }
+
+    // Copies positions, normals and triangles into buffer objects, recording the array layout in the vertex array object
+    void upload()
+    {
+        if (vao == 0)
+        {
+            glGenVertexArrays(1, &vao);
+            GLuint buffers[6];
+            glGenBuffers(6, buffers);
+            vertex_buffer = buffers[0];
+            triangle_buffer = buffers[1];
+            edge_buffer = buffers[2];
+            feature_edge_buffer = buffers[3];
+            sample_buffer = buffers[4];
+            instance_buffer = buffers[5];
+
+            glBindBuffer(GL_TEXTURE_BUFFER, instance_buffer);
+            glBufferData(GL_TEXTURE_BUFFER, 20 * sizeof(float), nullptr, GL_STREAM_DRAW);
+            glBindBuffer(GL_TEXTURE_BUFFER, 0);
+            glGenTextures(1, &instance_texture);
+            glBindTexture(GL_TEXTURE_BUFFER, instance_texture);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, instance_buffer);
+            glBindTexture(GL_TEXTURE_BUFFER, 0);
+        }
+
+        size_t bytes = vertices.size() * sizeof(Vector);
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+        glBufferData(GL_ARRAY_BUFFER, bytes * 2, nullptr, GL_STATIC_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, vertices.data());
+        glBufferSubData(GL_ARRAY_BUFFER, bytes, bytes, normals.data());
+        glEnableVertexAttribArray(position_attribute);
+        glEnableVertexAttribArray(normal_attribute);
+        glVertexAttribPointer(position_attribute, 3, GL_FLOAT, GL_FALSE, sizeof(struct Vector), (const void *)0);
+        glVertexAttribPointer(normal_attribute, 3, GL_FLOAT, GL_FALSE, sizeof(struct Vector), (const void *)bytes);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, triangle_buffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, triangles.size() * sizeof(unsigned int), triangles.data(), GL_STATIC_DRAW);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        gpu_dirty = false;
+        edges_uploaded = false;
+        feature_edges_uploaded = false;
+        samples_uploaded = false;
+    }
+
+    // Binds one of the index buffers to the bound vertex array, filling it from lines the first time
+    void bind_lines(GLuint buffer, const std::vector<unsigned int> &lines, bool &uploaded)
+    {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+        if (!uploaded)
+        {
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, lines.size() * sizeof(unsigned int), lines.data(), GL_STATIC_DRAW);
+            uploaded = true;
+        }
+    }
+
+    // Binds the shuffled vertex numbers to the bound vertex array, making them the first time
+    void bind_samples()
+    {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sample_buffer);
+        if (!samples_uploaded)
+        {
+            std::vector<unsigned int> order(vertices.size());
+            for (size_t i = 0; i < order.size(); ++i)
+                order[i] = (unsigned int)i;
+            std::shuffle(order.begin(), order.end(), std::mt19937());
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, order.size() * sizeof(unsigned int), order.data(), GL_STATIC_DRAW);
+            samples_uploaded = true;
+        }
+    }
+
+    // Starts building the edge list on another thread unless it is built or on its way
+    void start_edges()
+    {
+        if (edges_ready || edges_task.valid() || triangles.empty())
+            return;
+        edges_task = std::async(std::launch::async, [this]()
+        {
+            make_edges();
+            solid = is_solid();
+            edges_ready = true;
+            redraw_needed = true;
+            glfwPostEmptyEvent();
+        });
+    }
+
+    void start_feature_edges()
+    {
+        if (feature_edges_ready || feature_edges_task.valid() || triangles.empty())
+            return;
+        feature_edges_task = std::async(std::launch::async, [this]()
+        {
+            make_feature_edges(feature_angle);
+            feature_edges_ready = true;
+            redraw_needed = true;
+            glfwPostEmptyEvent();
+        });
+    }
+
+    // Starts simplifying on another thread, for big meshes only
+    void start_lods()
+    {
+        if (lods_ready || lods_task.valid() || triangles.size() / 3 < lod_min_triangles)
+            return;
+        lods_task = std::async(std::launch::async, [this]()
+        {
+            make_lods();
+            if (tasks_cancelled)
+                return;
+            lods_ready = true;
+            redraw_needed = true;
+            glfwPostEmptyEvent();
+        });
+    }
+
+    void start_bvh()
+    {
+        if (bvh_ready || bvh_task.valid() || triangles.empty())
+            return;
+        bvh_task = std::async(std::launch::async, [this]()
+        {
+            make_bvh();
+            glfwPostEmptyEvent();
+        });
+    }
+
+    void start_point_tree()
+    {
+        if (point_tree_ready || point_tree_task.valid() || vertices.empty())
+            return;
+        point_tree_task = std::async(std::launch::async, [this]()
+        {
+            make_point_tree();
+            glfwPostEmptyEvent();
+        });
+    }
+
+    void wait_for_tasks()
+    {
+        if (edges_task.valid())
+            edges_task.get();
+        if (feature_edges_task.valid())
+            feature_edges_task.get();
+        if (lods_task.valid())
+            lods_task.get();
+        if (bvh_task.valid())
+            bvh_task.get();
+        if (point_tree_task.valid())
+            point_tree_task.get();
+    }
+
+    unsigned int get_index(const Vector &v, const Vector &n)
+    {
+        if (indices.size() != vertices.size())
+            rebuild_indices();
+        VertexRecord r = { v, n };
+        bool inserted;
+        unsigned int index = indices.insert(r, (unsigned int)vertices.size(), inserted);
+        if (!inserted)
+            return index;
+        box_cached = false;
+        vertices.push_back(v);
+        normals.push_back(n);
+        return index;
+    }
+
+    // The map is dropped by finalize and not filled by the parallel loaders, so it is recreated the first time it is needed
+    void rebuild_indices()
+    {
+        indices.clear();
+        indices.reserve(vertices.size());
+        bool inserted;
+        for (size_t i = 0; i < vertices.size(); ++i)
+            indices.insert(VertexRecord{ vertices[i], normals[i] }, (unsigned int)i, inserted);
+    }
+
+    void read_stl(const char *filename)
+    {
+        MappedFile file;
+        if (!file.open(filename))
+        {
+            debug_print("cannot map %s\n", filename);
+            return;
+        }
+
+        if (file.size >= 6 && _strnicmp((const char *)file.data, "solid ", 6) == 0)
+        {
+            const char *text = (const char *)file.data + 6;
+            const char *text_end = (const char *)file.data + file.size;
+            if (weld_mode == WeldMode::Sort && vertices.empty())
+            {
+                std::vector<VertexRecord> corners;
+                read_ascii_stl(text, text_end, &corners);
+                weld_sorted(corners);
+            }
+            else
+                read_ascii_stl(text, text_end, nullptr);
+        }
+        else
+            read_binary_stl(file.data, file.size);
+        if (weld_tolerance > 0.0f)
+            merge_close_vertices(weld_tolerance);
+        if (crease_angle > 0.0f)
+            make_crease_normals(crease_angle);
+        finalize();
+    }
+
+    // Welds facets as they are read unless corners is given, then they are only collected there
+    bool read_ascii_stl(const char *text, const char *text_end, std::vector<VertexRecord> *corners)
+    {
+        Tokenizer tokens = { text, text_end };
+        int state = 0;
+        Record r;
+        bool first = true;
+        const char *token;
+        size_t length;
+        while (tokens.next(token, length))
+        {
+            int oldstate = state;
+            switch (state)
+            {
+            case 0:
+                if (token_is(token, length, "facet")) ++state;
+                if (token_is(token, length, "endsolid"))
+                    return true;
+                break;
+            case 1:
+                if (token_is(token, length, "normal")) ++state;
+                break;
+            case 2:
+                if (parse_real(token, length, &r.normal[0])) ++state;
+                break;
+            case 3:
+                if (parse_real(token, length, &r.normal[1])) ++state;
+                break;
+            case 4:
+                if (parse_real(token, length, &r.normal[2])) ++state;
+                break;
+            case 5:
+                if (token_is(token, length, "outer")) ++state;
+                break;
+            case 6:
+                if (token_is(token, length, "loop")) ++state;
+                break;
+            case 7:
+                if (token_is(token, length, "vertex")) ++state;
+                break;
+            case 8:
+                if (parse_real(token, length, &r.vertex1.x)) ++state;
+                break;
+            case 9:
+                if (parse_real(token, length, &r.vertex1.y)) ++state;
+                break;
+            case 10:
+                if (parse_real(token, length, &r.vertex1.z)) ++state;
+                break;
+            case 11:
+                if (token_is(token, length, "vertex")) ++state;
+                break;
+            case 12:
+                if (parse_real(token, length, &r.vertex2.x)) ++state;
+                break;
+            case 13:
+                if (parse_real(token, length, &r.vertex2.y)) ++state;
+                break;
+            case 14:
+                if (parse_real(token, length, &r.vertex2.z)) ++state;
+                break;
+            case 15:
+                if (token_is(token, length, "vertex")) ++state;
+                break;
+            case 16:
+                if (parse_real(token, length, &r.vertex3.x)) ++state;
+                break;
+            case 17:
+                if (parse_real(token, length, &r.vertex3.y)) ++state;
+                break;
+            case 18:
+                if (parse_real(token, length, &r.vertex3.z)) ++state;
+                break;
+            case 19:
+                if (token_is(token, length, "endloop")) ++state;
+                break;
+            case 20:
+                if (token_is(token, length, "endfacet"))
+                {
+
+                    Vector a = r.vertex2 - r.vertex1;
+                    Vector b = r.vertex3 - r.vertex1;
+                    Vector n = cross(a, b);
+                    n /= n.length();
+                    n = weld_normal(n);
+                    if (corners != nullptr)
+                    {
+                        corners->push_back(VertexRecord{ r.vertex1, n });
+                        corners->push_back(VertexRecord{ r.vertex2, n });
+                        corners->push_back(VertexRecord{ r.vertex3, n });
+                    }
+                    else
+                    {
+                        unsigned int i1 = get_index(r.vertex1, n);
+                        unsigned int i2 = get_index(r.vertex2, n);
+                        unsigned int i3 = get_index(r.vertex3, n);
+                        triangles.push_back(i1);
+                        triangles.push_back(i2);
+                        triangles.push_back(i3);
+                    }
+                    state = 0;
+                }
+                break;
+            }
+
+            if (!first && oldstate == state)
+            {
+                debug_print("unrecognize token %.*s\n", (int)length, token);
+                return false; // unrecognized token or out of order token
+            }
+            first = false;
+        }
+        return true;
+    }
+
+    bool read_binary_stl(const unsigned char *data, size_t size)
+    {
+        if (size < 84)
+            return false;
+
+        // Trust the file size over the header count so a bad header cannot walk past the mapping
+        unsigned int n_triangles;
+        memcpy(&n_triangles, data + 80, sizeof(n_triangles));
+        size_t n_available = (size - 84) / sizeof(PackedRecord);
+        bool complete = true;
+        if (n_triangles > n_available)
+        {
+            debug_print("binary stl claims %u facets but only has room for %zu\n", n_triangles, n_available);
+            n_triangles = (unsigned int)n_available;
+            complete = false;
+        }
+
+        const PackedRecord *records = (const PackedRecord *)(data + 84);
+        if (vertices.empty() && weld_mode == WeldMode::Sort)
+        {
+            read_binary_stl_sorted(records, n_triangles);
+            return complete;
+        }
+        if (vertices.empty() && n_triangles >= 2 * parallel_chunk_facets)
+        {
+            read_binary_stl_parallel(records, n_triangles);
+            return complete;
+        }
+
+        triangles.reserve(triangles.size() + (size_t)n_triangles * 3);
+        indices.reserve(indices.size() + (size_t)n_triangles * 3);
+        for (unsigned int i = 0; i < n_triangles; ++i)
+        {
+            const PackedRecord &r = records[i];
+            Vector a = r.vertex2 - r.vertex1;
+            Vector b = r.vertex3 - r.vertex1;
+            Vector n = cross(a, b);
+            if (n.length() == 0.0f)
+                continue;
+            n /= n.length();
+            n = weld_normal(n);
+            unsigned int i1 = get_index(r.vertex1, n);
+            unsigned int i2 = get_index(r.vertex2, n);
+            unsigned int i3 = get_index(r.vertex3, n);
+            triangles.push_back(i1);
+            triangles.push_back(i2);
+            triangles.push_back(i3);
+        }
+        return complete;
+    }
+
+    static const size_t parallel_chunk_facets = 16384;
+
+    // Weld state for one chunk of facets in the parallel loader
+    struct LoadChunk
+    {
+        std::vector<VertexRecord> unique;               // distinct corners in order of first use
+        std::vector<unsigned int> corners;              // index into unique for every kept corner
+        std::vector<std::vector<unsigned int>> shards;  // indices into unique grouped by merge shard
+        size_t unique_base = 0;
+        size_t first_count = 0;
+        size_t vertex_base = 0;
+        size_t triangle_base = 0;
+    };
+
+    // Same result as the serial loop, vertices are numbered in order of first use over the whole file.
+    // Facets are welded per chunk, the distinct corners are merged in hash shards, then renumbered.
+    void read_binary_stl_parallel(const PackedRecord *records, unsigned int n_triangles)
+    {
+        size_t n_chunks = (std::min)(worker_count() * 4, (size_t)n_triangles / parallel_chunk_facets);
+        size_t n_shards = worker_count();
+        std::vector<LoadChunk> chunks(n_chunks);
+
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            LoadChunk &chunk = chunks[c];
+            size_t begin = chunk_begin(c, n_chunks, n_triangles);
+            size_t end = chunk_begin(c + 1, n_chunks, n_triangles);
+            IndexMap local;
+            local.reserve((end - begin) * 3);
+            chunk.corners.reserve((end - begin) * 3);
+            chunk.shards.resize(n_shards);
+            for (size_t i = begin; i < end; ++i)
+            {
+                const PackedRecord &r = records[i];
+                Vector a = r.vertex2 - r.vertex1;
+                Vector b = r.vertex3 - r.vertex1;
+                Vector n = cross(a, b);
+                if (n.length() == 0.0f)
+                    continue;
+                n /= n.length();
+                n = weld_normal(n);
+                const Vector *pts[3] = { &r.vertex1, &r.vertex2, &r.vertex3 };
+                for (int k = 0; k < 3; ++k)
+                {
+                    VertexRecord vr = { *pts[k], n };
+                    bool inserted;
+                    unsigned int l = local.insert(vr, (unsigned int)chunk.unique.size(), inserted);
+                    if (inserted)
+                    {
+                        // Shard on the high bits, the tables index with the low ones
+                        chunk.shards[(Hasher()(vr) >> 32) % n_shards].push_back(l);
+                        chunk.unique.push_back(vr);
+                    }
+                    chunk.corners.push_back(l);
+                }
+            }
+        });
+
+        size_t n_unique = 0;
+        size_t n_corners = 0;
+        for (auto &chunk : chunks)
+        {
+            chunk.unique_base = n_unique;
+            chunk.triangle_base = n_corners;
+            n_unique += chunk.unique.size();
+            n_corners += chunk.corners.size();
+        }
+
+        // owner[g] is the first occurrence of distinct corner g over the whole file.
+        // Shards visit the chunks in file order so the first insertion is the first occurrence.
+        std::vector<unsigned int> owner(n_unique);
+        parallel_for(n_shards, [&](size_t s)
+        {
+            size_t n_shard = 0;
+            for (const auto &chunk : chunks)
+                n_shard += chunk.shards[s].size();
+            IndexMap shard;
+            shard.reserve(n_shard);
+            for (const auto &chunk : chunks)
+            {
+                for (unsigned int l : chunk.shards[s])
+                {
+                    unsigned int g = (unsigned int)(chunk.unique_base + l);
+                    bool inserted;
+                    owner[g] = shard.insert(chunk.unique[l], g, inserted);
+                }
+            }
+        });
+
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            LoadChunk &chunk = chunks[c];
+            for (size_t l = 0; l < chunk.unique.size(); ++l)
+            {
+                if (owner[chunk.unique_base + l] == chunk.unique_base + l)
+                    ++chunk.first_count;
+            }
+        });
+
+        size_t n_vertices = 0;
+        for (auto &chunk : chunks)
+        {
+            chunk.vertex_base = n_vertices;
+            n_vertices += chunk.first_count;
+        }
+
+        // Number the first occurrences, chunk by chunk in file order
+        std::vector<unsigned int> mesh_index(n_unique);
+        vertices.resize(n_vertices);
+        normals.resize(n_vertices);
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            LoadChunk &chunk = chunks[c];
+            size_t next = chunk.vertex_base;
+            for (size_t l = 0; l < chunk.unique.size(); ++l)
+            {
+                size_t g = chunk.unique_base + l;
+                if (owner[g] != g)
+                    continue;
+                mesh_index[g] = (unsigned int)next;
+                vertices[next] = chunk.unique[l].point;
+                normals[next] = chunk.unique[l].normal;
+                ++next;
+            }
+        });
+
+        // Later occurrences take the number of their owner, which always lies in an earlier chunk or earlier in this one
+        triangles.resize(n_corners);
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            LoadChunk &chunk = chunks[c];
+            for (size_t l = 0; l < chunk.unique.size(); ++l)
+            {
+                size_t g = chunk.unique_base + l;
+                if (owner[g] != g)
+                    mesh_index[g] = mesh_index[owner[g]];
+            }
+            for (size_t i = 0; i < chunk.corners.size(); ++i)
+                triangles[chunk.triangle_base + i] = mesh_index[chunk.unique_base + chunk.corners[i]];
+            chunk = LoadChunk();
+        });
+
+        box_cached = false;
+    }
+
+    // Gathers the corners of every non degenerate facet in parallel, keeping file order, then sorts them into vertices
+    void read_binary_stl_sorted(const PackedRecord *records, unsigned int n_triangles)
+    {
+        size_t n_chunks = (std::max)((size_t)1, (std::min)(worker_count() * 4, (size_t)n_triangles / parallel_chunk_facets));
+        std::vector<size_t> kept(n_chunks + 1, 0);
+
+        auto facet_normal = [](const PackedRecord &r, Vector &n)
+        {
+            n = cross(r.vertex2 - r.vertex1, r.vertex3 - r.vertex1);
+            if (n.length() == 0.0f)
+                return false;
+            n /= n.length();
+            n = weld_normal(n);
+            return true;
+        };
+
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, n_triangles);
+            Vector n;
+            for (size_t i = chunk_begin(c, n_chunks, n_triangles); i < end; ++i)
+            {
+                if (facet_normal(records[i], n))
+                    ++kept[c + 1];
+            }
+        });
+        for (size_t c = 0; c < n_chunks; ++c)
+            kept[c + 1] += kept[c];
+
+        std::vector<VertexRecord> corners(kept[n_chunks] * 3);
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, n_triangles);
+            VertexRecord *out = corners.data() + kept[c] * 3;
+            Vector n;
+            for (size_t i = chunk_begin(c, n_chunks, n_triangles); i < end; ++i)
+            {
+                const PackedRecord &r = records[i];
+                if (!facet_normal(r, n))
+                    continue;
+                *out++ = VertexRecord{ r.vertex1, n };
+                *out++ = VertexRecord{ r.vertex2, n };
+                *out++ = VertexRecord{ r.vertex3, n };
+            }
+        });
+
+        weld_sorted(corners);
+    }
+
+    // Builds vertices and triangles from a soup of facet corners by radix sorting the corner hashes,
+    // so equal corners end up in runs. Within a run the lowest corner number comes first and leads
+    // its group; numbering the leaders in corner order gives exactly what get_index would produce.
+    void weld_sorted(const std::vector<VertexRecord> &corners)
+    {
+        size_t n = corners.size();
+        std::vector<uint64_t> keys(n);
+        std::vector<unsigned int> order(n);
+        size_t n_chunks = (std::max)((size_t)1, (std::min)(worker_count() * 4, n / 65536));
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, n);
+            for (size_t i = chunk_begin(c, n_chunks, n); i < end; ++i)
+            {
+                keys[i] = Hasher()(corners[i]);
+                order[i] = (unsigned int)i;
+            }
+        });
+
+        radix_sort(keys, order);
+
+        std::vector<unsigned int> leader(n);
+        find_leaders(keys, order, n_chunks, [&](unsigned int a, unsigned int b) { return corners[a] == corners[b]; }, leader);
+        keys = std::vector<uint64_t>();
+
+        // Prefix count of leaders in corner order gives the vertex numbers, reusing order to hold them
+        std::vector<size_t> first_vertex(n_chunks + 1, 0);
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, n);
+            for (size_t i = chunk_begin(c, n_chunks, n); i < end; ++i)
+            {
+                if (leader[i] == i)
+                    ++first_vertex[c + 1];
+            }
+        });
+        for (size_t c = 0; c < n_chunks; ++c)
+            first_vertex[c + 1] += first_vertex[c];
+
+        std::vector<unsigned int> &vertex_of = order;
+        vertices.resize(first_vertex[n_chunks]);
+        normals.resize(first_vertex[n_chunks]);
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t next = first_vertex[c];
+            size_t end = chunk_begin(c + 1, n_chunks, n);
+            for (size_t i = chunk_begin(c, n_chunks, n); i < end; ++i)
+            {
+                if (leader[i] != i)
+                    continue;
+                vertex_of[i] = (unsigned int)next;
+                vertices[next] = corners[i].point;
+                normals[next] = corners[i].normal;
+                ++next;
+            }
+        });
+
+        triangles.resize(n);
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, n);
+            for (size_t i = chunk_begin(c, n_chunks, n); i < end; ++i)
+                triangles[i] = vertex_of[leader[i]];
+        });
+
+        box_cached = false;
+    }
+
+    Box model_box()
+    {
+        if (box_cached)
+            return box;
+        box_cached = true;
+        if (vertices.empty())
+        {
+            box = Box{ 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+            return box;
+        }
+
+        float xmax = vertices[0].x, xmin = vertices[0].x;
+        float ymax = vertices[0].y, ymin = vertices[0].y;
+        float zmax = vertices[0].z, zmin = vertices[0].z;
+
+        for (size_t i = 1; i < vertices.size(); ++i)
+        {
+            if (vertices[i].x < xmin)
+                xmin = vertices[i].x;
+            if (vertices[i].y < ymin)
+                ymin = vertices[i].y;
+            if (vertices[i].z < zmin)
+                zmin = vertices[i].z;
+            if (vertices[i].x > xmax)
+                xmax = vertices[i].x;
+            if (vertices[i].y > ymax)
+                ymax = vertices[i].y;
+            if (vertices[i].z > zmax)
+                zmax = vertices[i].z;
+        }
+
+        box = Box{ xmin, xmax, ymin, ymax, zmin, zmax };
+        return box;
+    }
+
+    // Merges vertices whose points lie within tolerance of each other, and whose normals agree to
+    // within weld_normal_cos, into the first of them. Points are bucketed in a uniform grid with
+    // cells twice the tolerance, so only the 2x2x2 block of cells nearest a point can hold a match.
+    // Triangles that collapse to a line or a point are dropped.
+    void merge_close_vertices(float tolerance)
+    {
+        if (vertices.empty())
+            return;
+
+        Box b = model_box();
+        float cell = (std::max)(tolerance * 2.0f, b.size() / (1 << 20));
+        if (cell <= 0.0f)
+            cell = 1.0f;
+        Vector origin = { b.xmin, b.ymin, b.zmin };
+        float tolerance2 = tolerance * tolerance;
+
+        // Representative points, each heading a list of the output vertices that share it
+        std::vector<Vector> rep_point;
+        std::vector<unsigned int> rep_next;     // next representative in the same cell
+        std::vector<unsigned int> rep_vertices; // first output vertex of the representative
+        std::vector<unsigned int> vertex_next;  // next output vertex of the same representative
+        std::unordered_map<uint64_t, unsigned int> grid;
+        grid.reserve(vertices.size());
+
+        std::vector<Vector> out_vertices;
+        std::vector<Vector> out_normals;
+        std::vector<unsigned int> vertex_map(vertices.size());
+        std::vector<unsigned int> vertex_rep(vertices.size());
+        const unsigned int none = ~0u;
+
+        auto cell_key = [](int ix, int iy, int iz)
+        {
+            return ((uint64_t)(unsigned int)ix << 42) | ((uint64_t)(unsigned int)iy << 21) | (uint64_t)(unsigned int)iz;
+        };
+
+        for (size_t v = 0; v < vertices.size(); ++v)
+        {
+            Vector p = vertices[v];
+            float fx = (p.x - origin.x) / cell;
+            float fy = (p.y - origin.y) / cell;
+            float fz = (p.z - origin.z) / cell;
+            int ix = (int)fx, iy = (int)fy, iz = (int)fz;
+            int nx = fx - ix < 0.5f ? ix - 1 : ix + 1;
+            int ny = fy - iy < 0.5f ? iy - 1 : iy + 1;
+            int nz = fz - iz < 0.5f ? iz - 1 : iz + 1;
+
+            unsigned int rep = none;
+            for (int k = 0; k < 8 && rep == none; ++k)
+            {
+                auto it = grid.find(cell_key((k & 1) ? nx : ix, (k & 2) ? ny : iy, (k & 4) ? nz : iz));
+                if (it == grid.end())
+                    continue;
+                for (unsigned int r = it->second; r != none; r = rep_next[r])
+                {
+                    Vector d = rep_point[r] - p;
+                    if (dot(d, d) <= tolerance2)
+                    {
+                        rep = r;
+                        break;
+                    }
+                }
+            }
+
+            if (rep == none)
+            {
+                rep = (unsigned int)rep_point.size();
+                auto ins = grid.insert(std::make_pair(cell_key(ix, iy, iz), rep));
+                rep_next.push_back(ins.second ? none : ins.first->second);
+                ins.first->second = rep;
+                rep_point.push_back(p);
+                rep_vertices.push_back(none);
+            }
+
+            unsigned int out = rep_vertices[rep];
+            while (out != none && !(out_normals[out] == normals[v]) && dot(out_normals[out], normals[v]) < weld_normal_cos)
+                out = vertex_next[out];
+            if (out == none)
+            {
+                out = (unsigned int)out_vertices.size();
+                out_vertices.push_back(rep_point[rep]);
+                out_normals.push_back(normals[v]);
+                vertex_next.push_back(rep_vertices[rep]);
+                rep_vertices[rep] = out;
+            }
+            vertex_map[v] = out;
+            vertex_rep[v] = rep;
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < triangles.size(); i += 3)
+        {
+            unsigned int v0 = triangles[i], v1 = triangles[i + 1], v2 = triangles[i + 2];
+            if (vertex_rep[v0] == vertex_rep[v1] || vertex_rep[v1] == vertex_rep[v2] || vertex_rep[v2] == vertex_rep[v0])
+                continue;
+            triangles[kept++] = vertex_map[v0];
+            triangles[kept++] = vertex_map[v1];
+            triangles[kept++] = vertex_map[v2];
+        }
+
+        debug_print("tolerance weld: %zu vertices to %zu, %zu triangles to %zu\n",
+            vertices.size(), out_vertices.size(), triangles.size() / 3, kept / 3);
+        triangles.resize(kept);
+        vertices.swap(out_vertices);
+        normals.swap(out_normals);
+        indices.clear();
+        box_cached = false;
+    }
+
+    // Splits position only vertices into one vertex per smoothing group. The normal at a corner is the
+    // area weighted sum of the normals of the facets around the vertex that are within angle degrees
+    // of the corner's own facet; corners whose sums agree share a vertex. Vertices are processed in
+    // parallel over the corners grouped by a radix sort on vertex number, and numbered in vertex order.
+    void make_crease_normals(float angle)
+    {
+        size_t n_faces = triangles.size() / 3;
+        size_t n_corners = triangles.size();
+        size_t n_vertices = vertices.size();
+        float cos_crease = cosf(angle * (float)M_PI / 180.0f);
+
+        std::vector<Vector> face_normal(n_faces);
+        std::vector<Vector> face_unit(n_faces);
+        std::vector<uint64_t> keys(n_corners);
+        std::vector<unsigned int> corner_order(n_corners);
+        size_t n_chunks = (std::max)((size_t)1, (std::min)(worker_count() * 4, n_faces / 16384));
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, n_faces);
+            for (size_t f = chunk_begin(c, n_chunks, n_faces); f < end; ++f)
+            {
+                const Vector &a = vertices[triangles[f * 3]];
+                Vector n = cross(vertices[triangles[f * 3 + 1]] - a, vertices[triangles[f * 3 + 2]] - a);
+                face_normal[f] = n;
+                float length = n.length();
+                face_unit[f] = length > 0.0f ? n / length : Vector{ 0.0f, 0.0f, 0.0f };
+                for (size_t k = f * 3; k < f * 3 + 3; ++k)
+                {
+                    keys[k] = triangles[k];
+                    corner_order[k] = (unsigned int)k;
+                }
+            }
+        });
+
+        radix_sort(keys, corner_order);
+        keys = std::vector<uint64_t>();
+
+        // corner_order now lists the corners of vertex 0, then vertex 1 and so on
+        std::vector<size_t> vertex_corners(n_vertices + 1, 0);
+        for (size_t k = 0; k < n_corners; ++k)
+            ++vertex_corners[triangles[k] + 1];
+        for (size_t v = 0; v < n_vertices; ++v)
+            vertex_corners[v + 1] += vertex_corners[v];
+
+        std::vector<Vector> corner_normal(n_corners);
+        std::vector<unsigned int> corner_group(n_corners);
+        std::vector<size_t> first_vertex(n_vertices + 1, 0);
+        size_t n_vertex_chunks = (std::max)((size_t)1, (std::min)(worker_count() * 4, n_vertices / 16384));
+        parallel_for(n_vertex_chunks, [&](size_t c)
+        {
+            std::vector<Vector> groups;
+            size_t end = chunk_begin(c + 1, n_vertex_chunks, n_vertices);
+            for (size_t v = chunk_begin(c, n_vertex_chunks, n_vertices); v < end; ++v)
+            {
+                groups.clear();
+                for (size_t i = vertex_corners[v]; i < vertex_corners[v + 1]; ++i)
+                {
+                    unsigned int corner = corner_order[i];
+                    const Vector &own = face_unit[corner / 3];
+                    Vector sum = { 0.0f, 0.0f, 0.0f };
+                    for (size_t j = vertex_corners[v]; j < vertex_corners[v + 1]; ++j)
+                    {
+                        unsigned int other = corner_order[j] / 3;
+                        if (other == corner / 3 || dot(own, face_unit[other]) >= cos_crease)
+                            sum += face_normal[other];
+                    }
+                    float length = sum.length();
+                    Vector n = length > 0.0f ? sum / length : own;
+
+                    size_t g = 0;
+                    while (g < groups.size() && !(groups[g] == n))
+                        ++g;
+                    if (g == groups.size())
+                        groups.push_back(n);
+                    corner_normal[corner] = n;
+                    corner_group[corner] = (unsigned int)g;
+                }
+                first_vertex[v + 1] = groups.size();
+            }
+        });
+        for (size_t v = 0; v < n_vertices; ++v)
+            first_vertex[v + 1] += first_vertex[v];
+
+        std::vector<Vector> out_vertices(first_vertex[n_vertices]);
+        std::vector<Vector> out_normals(first_vertex[n_vertices]);
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, n_faces) * 3;
+            for (size_t k = chunk_begin(c, n_chunks, n_faces) * 3; k < end; ++k)
+            {
+                unsigned int v = triangles[k];
+                unsigned int out = (unsigned int)(first_vertex[v] + corner_group[k]);
+                out_vertices[out] = vertices[v];
+                out_normals[out] = corner_normal[k];
+                triangles[k] = out;
+            }
+        });
+
+        debug_print("crease normals: %zu positions to %zu vertices\n", n_vertices, out_vertices.size());
+        vertices.swap(out_vertices);
+        normals.swap(out_normals);
+        indices.clear();
+        box_cached = false;
+    }
+
+    size_t instance_count() const
+    {
+        return instances.empty() ? 1 : instances.size();
+    }
+
+    void instance_transform(size_t i, mat4x4 t) const
+    {
+        if (instances.empty())
+            mat4x4_identity(t);
+        else
+            mat4x4_dup(t, (vec4 *)instances[i].transform);
+    }
+
+    // The box around every instance, in scene coordinates
+    Box world_box()
+    {
+        Box local = model_box();
+        if (instances.empty())
+            return local;
+        Box b;
+        for (size_t i = 0; i < instances.size(); ++i)
+        {
+            mat4x4 t;
+            instance_transform(i, t);
+            for (int c = 0; c < 8; ++c)
+            {
+                Vector p = transform_point(t, Vector{ c & 1 ? local.xmax : local.xmin, c & 2 ? local.ymax : local.ymin, c & 4 ? local.zmax : local.zmin });
+                Box point = { p.x, p.x, p.y, p.y, p.z, p.z };
+                if (i == 0 && c == 0)
+                    b = point;
+                else
+                    b += point;
+            }
+        }
+        return b;
+    }
+
+    // Draws the instances in view with the mesh program, which must be in use, in one instanced
+    // draw. Their transforms and colors go to the program through the instance texture.
+    // pixel_size is the size of a pixel in model units where the mesh is nearest the viewer; shaded
+    // views use the coarsest level of detail that is out by less than that. budget caps the number of
+    // triangles or lines: coarser levels are used to stay under it, and failing those a random sample
+    // of the vertices is drawn as points. A lone instance has its clusters culled. Returns the number
+    // of primitives drawn.
+    size_t render(bool wireframe, bool features, float pixel_size, size_t budget, const ViewVolume &view)
+    {
+        if (vertices.empty())
+            return 0;
+        if (gpu_dirty)
+            upload();
+
+        Box b = model_box();
+        Vector c = b.center();
+        float radius = (Vector{ b.xmax, b.ymax, b.zmax } - c).length();
+        instance_data.clear();
+        size_t last = 0;
+        for (size_t i = 0; i < instance_count(); ++i)
+        {
+            mat4x4 t;
+            instance_transform(i, t);
+            if (view.cull && !view.in_frustum(transform_point(t, c), radius * transform_scale(t)))
+                continue;
+            // The instance number rides along after the color for the ID pass
+            const Color &tint = instances.empty() ? color : instances[i].color;
+            instance_data.insert(instance_data.end(), &t[0][0], &t[0][0] + 16);
+            instance_data.insert(instance_data.end(), { tint.r, tint.g, tint.b, (float)i });
+            last = i;
+        }
+        size_t n = instance_data.size() / 20;
+        if (n == 0)
+            return 0;
+
+        glBindBuffer(GL_TEXTURE_BUFFER, instance_buffer);
+        glBufferData(GL_TEXTURE_BUFFER, instance_data.size() * sizeof(float), instance_data.data(), GL_STREAM_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        glActiveTexture(GL_TEXTURE0 + instance_unit);
+        glBindTexture(GL_TEXTURE_BUFFER, instance_texture);
+        glActiveTexture(GL_TEXTURE0);
+
+        // Only the full mesh has edge lists, so a wireframe stays on it and falls back to its points
+        size_t per_instance = (std::max)(budget / n, (size_t)1);
+        Mesh *level = this;
+        if (!wireframe && lods_ready)
+        {
+            for (const auto &l : lods)
+            {
+                if (l->lod_error < pixel_size || level->triangles.size() / 3 > per_instance)
+                    level = l.get();
+            }
+            if (level->triangles.size() / 3 > per_instance)
+                level = this;
+            level->solid = solid.load();
+        }
+        drawn_level = level;
+
+        ViewVolume local;
+        if (n == 1 && view.cull)
+        {
+            mat4x4 t;
+            instance_transform(last, t);
+            local = view.placed(t);
+        }
+        return level->draw(wireframe, features, per_instance, n, local);
+    }
+
+    // Draws n instances of the mesh itself, or for a single instance just the clusters in view. A
+    // wireframe whose lines are not built yet or are over budget shows the point sample instead, so
+    // it never turns into a solid mid-drag.
+    size_t draw(bool wireframe, bool features, size_t budget, size_t n, const ViewVolume &view)
+    {
+        if (gpu_dirty)
+            upload();
+
+        glBindVertexArray(vao);
+        size_t drawn;
+        if (wireframe && features && feature_edges_ready && feature_edges.size() / 2 <= budget)
+        {
+            bind_lines(feature_edge_buffer, feature_edges, feature_edges_uploaded);
+            glDrawElementsInstanced(GL_LINES, (int)feature_edges.size(), GL_UNSIGNED_INT, nullptr, (GLsizei)n);
+            drawn = feature_edges.size() / 2;
+        }
+        else if (wireframe && !features && edges_ready && edges.size() / 2 <= budget)
+        {
+            bind_lines(edge_buffer, edges, edges_uploaded);
+            glDrawElementsInstanced(GL_LINES, (int)edges.size(), GL_UNSIGNED_INT, nullptr, (GLsizei)n);
+            drawn = edges.size() / 2;
+        }
+        else if (!wireframe && triangles.size() / 3 <= budget && n == 1 && view.cull && !clusters.empty())
+        {
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, triangle_buffer);
+            drawn = draw_clusters(view) / 3;
+        }
+        else if (!wireframe && triangles.size() / 3 <= budget)
+        {
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, triangle_buffer);
+            glDrawElementsInstanced(GL_TRIANGLES, (int)triangles.size(), GL_UNSIGNED_INT, nullptr, (GLsizei)n);
+            drawn = triangles.size() / 3;
+        }
+        else
+        {
+            drawn = (std::min)(budget, vertices.size());
+            bind_samples();
+            glDrawElementsInstanced(GL_POINTS, (int)drawn, GL_UNSIGNED_INT, nullptr, (GLsizei)n);
+        }
+        glBindVertexArray(0);
+        return drawn * n;
+    }
+
+    // Draws the clusters the view can see, joining neighbours into runs for a single multi draw.
+    // Returns the number of indices drawn.
+    size_t draw_clusters(const ViewVolume &view)
+    {
+        run_counts.clear();
+        run_offsets.clear();
+        size_t run_end = ~(size_t)0;
+        size_t drawn = 0;
+        for (const Cluster &c : clusters)
+        {
+            if (!view.sees(c, solid))
+                continue;
+            if (c.first == run_end)
+                run_counts.back() += c.count;
+            else
+            {
+                run_counts.push_back(c.count);
+                run_offsets.push_back((const void *)(c.first * sizeof(unsigned int)));
+            }
+            run_end = c.first + c.count;
+            drawn += c.count;
+        }
+        if (!run_counts.empty())
+            glMultiDrawElements(GL_TRIANGLES, run_counts.data(), GL_UNSIGNED_INT, run_offsets.data(), (GLsizei)run_counts.size());
+        return drawn;
+    }
+
+    void clear()
+    {
+        tasks_cancelled = true;
+        wait_for_tasks();
+        tasks_cancelled = false;
+        edges_ready = false;
+        feature_edges_ready = false;
+        feature_edges.clear();
+        solid = false;
+        lods_ready = false;
+        lods.clear();
+        drawn_level = nullptr;
+        gpu_dirty = true;
+        box_cached = false;
+        vertices.clear();
+        normals.clear();
+        indices.clear();
+        triangles.clear();
+        edges.clear();
+        clusters.clear();
+        bvh.clear();
+        bvh_packs.clear();
+        bvh_ready = false;
+        point_tree.clear();
+        point_tree_points.clear();
+        point_tree_ready = false;
+    }
+
+    // Drops the weld map and trims the arrays to size once the mesh is built, then puts the triangles
+    // in clusters. get_index recreates the map if the mesh is extended later.
+    void finalize()
+    {
+        gpu_dirty = true;
+        indices.release();
+        vertices.shrink_to_fit();
+        normals.shrink_to_fit();
+        triangles.shrink_to_fit();
+        edges.shrink_to_fit();
+        make_clusters();
+    }
+
+    // Sorts the triangles along a Morton curve through their centroids, so runs of them stay close
+    // together, and cuts the list into clusters of 128 with their bounds and normal cones
+    void make_clusters()
+    {
+        const size_t cluster_size = 128;
+        size_t n_faces = triangles.size() / 3;
+        clusters.clear();
+        if (n_faces == 0)
+            return;
+
+        box_cached = false;
+        Box b = model_box();
+        float extent = (std::max)(b.size(), FLT_MIN);
+        std::vector<uint64_t> keys(n_faces);
+        std::vector<unsigned int> order(n_faces);
+        size_t n_chunks = (std::max)((size_t)1, (std::min)(worker_count() * 4, n_faces / 16384));
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, n_faces);
+            for (size_t f = chunk_begin(c, n_chunks, n_faces); f < end; ++f)
+            {
+                Vector centroid = (vertices[triangles[f * 3]] + vertices[triangles[f * 3 + 1]] + vertices[triangles[f * 3 + 2]]) / 3.0f;
+                uint32_t x = (uint32_t)((centroid.x - b.xmin) / extent * 1023.0f);
+                uint32_t y = (uint32_t)((centroid.y - b.ymin) / extent * 1023.0f);
+                uint32_t z = (uint32_t)((centroid.z - b.zmin) / extent * 1023.0f);
+                keys[f] = morton_spread(x) | (morton_spread(y) << 1) | (morton_spread(z) << 2);
+                order[f] = (unsigned int)f;
+            }
+        });
+        radix_sort(keys, order);
+        keys = std::vector<uint64_t>();
+
+        std::vector<unsigned int> sorted(triangles.size());
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, n_faces);
+            for (size_t f = chunk_begin(c, n_chunks, n_faces); f < end; ++f)
+                memcpy(&sorted[f * 3], &triangles[order[f] * 3], 3 * sizeof(unsigned int));
+        });
+        triangles.swap(sorted);
+        sorted = std::vector<unsigned int>();
+
+        clusters.resize((n_faces + cluster_size - 1) / cluster_size);
+        parallel_for(clusters.size(), [&](size_t i)
+        {
+            Cluster &c = clusters[i];
+            size_t begin = i * cluster_size;
+            size_t end = (std::min)(begin + cluster_size, n_faces);
+            c.first = (unsigned int)(begin * 3);
+            c.count = (unsigned int)((end - begin) * 3);
+
+            Box bounds = { FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX };
+            Vector sum = { 0.0f, 0.0f, 0.0f };
+            for (size_t k = begin * 3; k < end * 3; ++k)
+            {
+                const Vector &v = vertices[triangles[k]];
+                bounds += Box{ v.x, v.x, v.y, v.y, v.z, v.z };
+            }
+            c.center = bounds.center();
+            c.radius = 0.0f;
+            for (size_t k = begin * 3; k < end * 3; ++k)
+                c.radius = (std::max)(c.radius, (vertices[triangles[k]] - c.center).length());
+
+            for (size_t f = begin; f < end; ++f)
+            {
+                const Vector &a = vertices[triangles[f * 3]];
+                Vector n = cross(vertices[triangles[f * 3 + 1]] - a, vertices[triangles[f * 3 + 2]] - a);
+                float length = n.length();
+                if (length > 0.0f)
+                    sum += n / length;
+            }
+            float length = sum.length();
+            c.axis = length > 0.0f ? sum / length : Vector{ 0.0f, 0.0f, 1.0f };
+            float min_dot = length > 0.0f ? 1.0f : -1.0f;
+            for (size_t f = begin; f < end && min_dot > 0.0f; ++f)
+            {
+                const Vector &a = vertices[triangles[f * 3]];
+                Vector n = cross(vertices[triangles[f * 3 + 1]] - a, vertices[triangles[f * 3 + 2]] - a);
+                float nl = n.length();
+                if (nl > 0.0f)
+                    min_dot = (std::min)(min_dot, dot(n, c.axis) / nl);
+            }
+            c.cutoff = min_dot > 0.0f ? sqrtf(1.0f - min_dot * min_dot) : 2.0f;
+        });
+    }
+
+    uint64_t make_edge_id(unsigned int a, unsigned int b) const
+    {
+        if (a < b)
+            return ((uint64_t)a << 32) | b;
+        else
+            return ((uint64_t)b << 32) | a;
+    }
+
+    // Unique edges in order of first use, each drawn in the direction of its first triangle.
+    // Edge slot 3t+e runs from corner e of triangle t to the next corner. The packed edge ids are
+    // radix sorted with their slots; the first slot of each run of equal ids marks the edge, and the
+    // marked slots are compacted in slot order, giving the same list the hash set version built.
+    void make_edges()
+    {
+        size_t n = triangles.size();
+        std::vector<uint64_t> keys(n);
+        std::vector<unsigned int> slots(n);
+        size_t n_chunks = (std::max)((size_t)1, (std::min)(worker_count() * 4, n / 65536));
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, n / 3) * 3;
+            for (size_t i = chunk_begin(c, n_chunks, n / 3) * 3; i < end; i += 3)
+            {
+                for (int e = 0; e < 3; ++e)
+                {
+                    keys[i + e] = make_edge_id(triangles[i + e], triangles[i + (e == 2 ? 0 : e + 1)]);
+                    slots[i + e] = (unsigned int)(i + e);
+                }
+            }
+        });
+
+        radix_sort(keys, slots);
+
+        std::vector<unsigned char> first(n, 0);
+        std::vector<size_t> runs = run_chunks(keys, n_chunks);
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            for (size_t i = runs[c]; i < runs[c + 1]; ++i)
+            {
+                if (i == runs[c] || keys[i] != keys[i - 1])
+                    first[slots[i]] = 1;
+            }
+        });
+        keys = std::vector<uint64_t>();
+        slots = std::vector<unsigned int>();
+
+        std::vector<size_t> first_edge(n_chunks + 1, 0);
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, n);
+            for (size_t i = chunk_begin(c, n_chunks, n); i < end; ++i)
+                first_edge[c + 1] += first[i];
+        });
+        for (size_t c = 0; c < n_chunks; ++c)
+            first_edge[c + 1] += first_edge[c];
+
+        edges.resize(first_edge[n_chunks] * 2);
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            unsigned int *out = edges.data() + first_edge[c] * 2;
+            size_t end = chunk_begin(c + 1, n_chunks, n);
+            for (size_t i = chunk_begin(c, n_chunks, n); i < end; ++i)
+            {
+                if (!first[i])
+                    continue;
+                size_t t = i - i % 3;
+                *out++ = triangles[i];
+                *out++ = triangles[i % 3 == 2 ? t : i + 1];
+            }
+        });
+    }
+
+    // For every vertex, the lowest numbered vertex at the same point, whatever its normal
+    std::vector<unsigned int> position_leaders() const
+    {
+        size_t n = vertices.size();
+        std::vector<uint64_t> keys(n);
+        std::vector<unsigned int> order(n);
+        size_t n_chunks = (std::max)((size_t)1, (std::min)(worker_count() * 4, n / 65536));
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, n);
+            for (size_t i = chunk_begin(c, n_chunks, n); i < end; ++i)
+            {
+                keys[i] = Hasher()(VertexRecord{ vertices[i], Vector{ 0.0f, 0.0f, 0.0f } });
+                order[i] = (unsigned int)i;
+            }
+        });
+        radix_sort(keys, order);
+        std::vector<unsigned int> leader(n);
+        find_leaders(keys, order, n_chunks, [&](unsigned int a, unsigned int b) { return vertices[a] == vertices[b]; }, leader);
+        return leader;
+    }
+
+    // Splits the triangles into parts joined through shared points, given the position leaders, and
+    // lists the triangle numbers of each part in order
+    std::vector<std::vector<unsigned int>> connected_faces(const std::vector<unsigned int> &leader) const
+    {
+        // Union find over vertices, each starting joined to the leader of its point
+        std::vector<unsigned int> parent(leader);
+        auto find = [&](unsigned int v)
+        {
+            while (parent[v] != v)
+            {
+                parent[v] = parent[parent[v]];
+                v = parent[v];
+            }
+            return v;
+        };
+        size_t n_faces = triangles.size() / 3;
+        for (size_t f = 0; f < n_faces; ++f)
+        {
+            unsigned int a = find(triangles[f * 3]);
+            for (int k = 1; k < 3; ++k)
+            {
+                unsigned int b = find(triangles[f * 3 + k]);
+                if (a < b)
+                    parent[b] = a;
+                else if (b < a)
+                {
+                    parent[a] = b;
+                    a = b;
+                }
+            }
         }
 
-        float xmax = vertices[0].x, xmin = vertices[0].x;
-        float ymax = vertices[0].y, ymin = vertices[0].y;
-        float zmax = vertices[0].z, zmin = vertices[0].z;
+        // Parts are numbered in the order of their first triangles
+        std::vector<std::vector<unsigned int>> parts;
+        std::vector<unsigned int> part_of(vertices.size(), ~0u);
+        for (size_t f = 0; f < n_faces; ++f)
+        {
+            unsigned int root = find(triangles[f * 3]);
+            if (part_of[root] == ~0u)
+            {
+                part_of[root] = (unsigned int)parts.size();
+                parts.emplace_back();
+            }
+            parts[part_of[root]].push_back((unsigned int)f);
+        }
+        return parts;
+    }
 
-        for (size_t i = 1; i < vertices.size(); ++i)
+    // Builds the mesh from some triangles of source and the vertices they use, moved by -offset
+    void copy_faces(const Mesh &source, const std::vector<unsigned int> &faces, const Vector &offset)
+    {
+        std::unordered_map<unsigned int, unsigned int> index;
+        index.reserve(faces.size());
+        triangles.reserve(faces.size() * 3);
+        for (unsigned int f : faces)
         {
-            if (vertices[i].x < xmin)
-                xmin = vertices[i].x;
-            if (vertices[i].y < ymin)
-                ymin = vertices[i].y;
-            if (vertices[i].x < zmin)
-                zmin = vertices[i].z;
-            if (vertices[i].x > xmax)
-                xmax = vertices[i].x;
-            if (vertices[i].y > ymax)
-                ymax = vertices[i].y;
-            if (vertices[i].x > zmax)
-                zmax = vertices[i].z;
+            for (int k = 0; k < 3; ++k)
+            {
+                unsigned int v = source.triangles[f * 3 + k];
+                auto ins = index.insert(std::make_pair(v, (unsigned int)vertices.size()));
+                if (ins.second)
+                {
+                    vertices.push_back(source.vertices[v] - offset);
+                    normals.push_back(source.normals[v]);
+                }
+                triangles.push_back(ins.first->second);
+            }
         }
+        color = source.color;
+        box_cached = false;
+        finalize();
+    }
 
-        box = Box{ xmin, xmax, ymin, ymax, zmin, zmax };
-        return box;
+    // True if every side, joined through shared points, meets exactly one other and the enclosed
+    // volume comes out positive, meaning the facets face outwards
+    bool is_solid() const
+    {
+        size_t n = triangles.size();
+        size_t n_faces = n / 3;
+        std::vector<unsigned int> point_id = position_leaders();
+        std::vector<uint64_t> keys(n);
+        std::vector<unsigned int> sides(n);
+        std::vector<double> volume(n_faces);
+        size_t n_chunks = (std::max)((size_t)1, (std::min)(worker_count() * 4, n_faces / 16384));
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, n_faces);
+            for (size_t f = chunk_begin(c, n_chunks, n_faces); f < end; ++f)
+            {
+                const unsigned int *t = &triangles[f * 3];
+                volume[f] = dot(vertices[t[0]], cross(vertices[t[1]], vertices[t[2]]));
+                for (int e = 0; e < 3; ++e)
+                {
+                    keys[f * 3 + e] = make_edge_id(point_id[t[e]], point_id[t[e == 2 ? 0 : e + 1]]);
+                    sides[f * 3 + e] = (unsigned int)(f * 3 + e);
+                }
+            }
+        });
+        point_id = std::vector<unsigned int>();
+        radix_sort(keys, sides);
+
+        for (size_t begin = 0; begin < n; )
+        {
+            size_t end = begin + 1;
+            while (end < n && keys[end] == keys[begin])
+                ++end;
+            if (end - begin != 2)
+                return false;
+            begin = end;
+        }
+
+        double total = 0.0;
+        for (double v : volume)
+            total += v;
+        return total > 0.0;
     }
 
-    void render(bool wireframe)
+    // Edges where the surface ends, branches or folds by more than angle degrees. Triangles are
+    // connected through shared points rather than vertex numbers, since a faceted mesh has separate
+    // vertices per facet normal. Sides are keyed on their point ids and radix sorted so each run holds
+    // the triangles on one edge: one is a boundary, more than two is non manifold, and for two the
+    // facet normals are compared. Lines use the vertices of the edge's first side, in side order.
+    void make_feature_edges(float angle)
     {
-        if (vertices.empty())
+        size_t n = triangles.size();
+        size_t n_faces = n / 3;
+        float cos_crease = cosf(angle * (float)M_PI / 180.0f);
+        std::vector<unsigned int> point_id = position_leaders();
+
+        std::vector<Vector> face_unit(n_faces);
+        std::vector<uint64_t> keys(n);
+        std::vector<unsigned int> sides(n);
+        size_t n_chunks = (std::max)((size_t)1, (std::min)(worker_count() * 4, n_faces / 16384));
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, n_faces);
+            for (size_t f = chunk_begin(c, n_chunks, n_faces); f < end; ++f)
+            {
+                const unsigned int *t = &triangles[f * 3];
+                Vector normal = cross(vertices[t[1]] - vertices[t[0]], vertices[t[2]] - vertices[t[0]]);
+                float length = normal.length();
+                face_unit[f] = length > 0.0f ? normal / length : Vector{ 0.0f, 0.0f, 0.0f };
+                for (int e = 0; e < 3; ++e)
+                {
+                    keys[f * 3 + e] = make_edge_id(point_id[t[e]], point_id[t[e == 2 ? 0 : e + 1]]);
+                    sides[f * 3 + e] = (unsigned int)(f * 3 + e);
+                }
+            }
+        });
+        point_id = std::vector<unsigned int>();
+
+        radix_sort(keys, sides);
+
+        std::vector<unsigned char> feature(n, 0);
+        size_t n_side_chunks = (std::max)((size_t)1, (std::min)(worker_count() * 4, n / 65536));
+        std::vector<size_t> runs = run_chunks(keys, n_side_chunks);
+        parallel_for(n_side_chunks, [&](size_t c)
+        {
+            size_t end = runs[c + 1];
+            for (size_t begin = runs[c]; begin < end; )
+            {
+                size_t run_end = begin + 1;
+                while (run_end < end && keys[run_end] == keys[begin])
+                    ++run_end;
+                bool crease = run_end - begin != 2 ||
+                    dot(face_unit[sides[begin] / 3], face_unit[sides[begin + 1] / 3]) < cos_crease;
+                if (crease && (keys[begin] >> 32) != (keys[begin] & 0xffffffff))
+                    feature[sides[begin]] = 1;
+                begin = run_end;
+            }
+        });
+        keys = std::vector<uint64_t>();
+        sides = std::vector<unsigned int>();
+
+        std::vector<size_t> first_edge(n_side_chunks + 1, 0);
+        parallel_for(n_side_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_side_chunks, n);
+            for (size_t i = chunk_begin(c, n_side_chunks, n); i < end; ++i)
+                first_edge[c + 1] += feature[i];
+        });
+        for (size_t c = 0; c < n_side_chunks; ++c)
+            first_edge[c + 1] += first_edge[c];
+
+        feature_edges.resize(first_edge[n_side_chunks] * 2);
+        parallel_for(n_side_chunks, [&](size_t c)
+        {
+            unsigned int *out = feature_edges.data() + first_edge[c] * 2;
+            size_t end = chunk_begin(c + 1, n_side_chunks, n);
+            for (size_t i = chunk_begin(c, n_side_chunks, n); i < end; ++i)
+            {
+                if (!feature[i])
+                    continue;
+                size_t t = i - i % 3;
+                *out++ = triangles[i];
+                *out++ = triangles[i % 3 == 2 ? t : i + 1];
+            }
+        });
+        debug_print("feature edges: %zu of %zu triangle sides\n", feature_edges.size() / 2, n);
+    }
+
+    // Builds the hierarchy, then copies each leaf's triangles into packs for the ray test so a leaf
+    // is read from one place
+    void make_bvh()
+    {
+        size_t n_faces = triangles.size() / 3;
+        std::vector<Box> bounds(n_faces);
+        std::vector<Vector> centroids(n_faces);
+        std::vector<unsigned int> faces(n_faces);
+        size_t n_chunks = (std::max)((size_t)1, (std::min)(worker_count() * 4, n_faces / 16384));
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, n_faces);
+            for (size_t f = chunk_begin(c, n_chunks, n_faces); f < end; ++f)
+            {
+                const Vector &a = vertices[triangles[f * 3]];
+                const Vector &b = vertices[triangles[f * 3 + 1]];
+                const Vector &d = vertices[triangles[f * 3 + 2]];
+                bounds[f] = Box{ (std::min)(a.x, (std::min)(b.x, d.x)), (std::max)(a.x, (std::max)(b.x, d.x)),
+                                 (std::min)(a.y, (std::min)(b.y, d.y)), (std::max)(a.y, (std::max)(b.y, d.y)),
+                                 (std::min)(a.z, (std::min)(b.z, d.z)), (std::max)(a.z, (std::max)(b.z, d.z)) };
+                centroids[f] = (a + b + d) / 3.0f;
+                faces[f] = (unsigned int)f;
+            }
+        });
+
+        int depth = 0;
+        while ((size_t)1 << depth < worker_count())
+            ++depth;
+        bvh.clear();
+        if (n_faces > 0)
+            BvhBuilder{ bounds.data(), centroids.data(), faces.data(), tasks_cancelled }.build(bvh, 0, (unsigned int)n_faces, depth + 1);
+        if (tasks_cancelled)
+        {
+            bvh.clear();
             return;
+        }
+        bvh.shrink_to_fit();
 
-        glColor3f(color.r, color.g, color.b);
-        glVertexPointer(3, GL_FLOAT, sizeof(struct Vector), &vertices[0]);
-        glNormalPointer(GL_FLOAT, sizeof(struct Vector), &normals[0]);
-        if (wireframe)
+        // Leaves come in the same order as their triangles, so a running count gives each its packs
+        std::vector<size_t> leaves;
+        size_t n_packs = 0;
+        for (size_t i = 0; i < bvh.size(); ++i)
         {
-            glDrawElements(GL_LINES, (int)edges.size(), GL_UNSIGNED_INT, &edges[0]);
+            if (bvh[i].count == 0)
+                continue;
+            leaves.push_back(i);
+            n_packs += (bvh[i].count + 3) / 4;
         }
-        else
+        bvh_packs.assign(n_packs, TrianglePack());
+        std::vector<unsigned int> leaf_packs(leaves.size());
+        n_packs = 0;
+        for (size_t l = 0; l < leaves.size(); ++l)
         {
-            glDrawElements(GL_TRIANGLES, (int)triangles.size(), GL_UNSIGNED_INT, &triangles[0]);
+            leaf_packs[l] = (unsigned int)n_packs;
+            n_packs += (bvh[leaves[l]].count + 3) / 4;
         }
+        n_chunks = (std::max)((size_t)1, (std::min)(worker_count() * 4, leaves.size() / 4096));
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, leaves.size());
+            for (size_t l = chunk_begin(c, n_chunks, leaves.size()); l < end; ++l)
+            {
+                BvhNode &node = bvh[leaves[l]];
+                for (unsigned int k = 0; k < node.count; k += 4)
+                    pack_triangles(bvh_packs[leaf_packs[l] + k / 4], vertices.data(), triangles.data(), &faces[node.first + k], (std::min)(4u, node.count - k));
+                node.first = leaf_packs[l];
+            }
+        });
+        bvh_ready = true;
+        debug_print("bvh: %zu nodes, %zu packs over %zu triangles\n", bvh.size(), bvh_packs.size(), n_faces);
     }
 
-    void clear()
+    // Finds where the ray, in mesh coordinates, first meets the mesh nearer than hit.t, which is
+    // then updated. Distances are in lengths of the ray direction, so they carry over unchanged to
+    // the ray before it was transformed. Nodes are visited nearest first and skipped once they start
+    // beyond the nearest hit so far.
+    bool intersect(const Ray &ray, RayHit &hit)
     {
-        box_cached = false;
-        vertices.clear();
-        normals.clear();
-        indices.clear();
-        triangles.clear();
-        edges.clear();
+        if (!bvh_ready)
+        {
+            if (bvh_task.valid())
+                bvh_task.get();
+            else
+                make_bvh();
+        }
+        if (bvh.empty())
+            return false;
+
+        Vector inverse = { 1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z };
+        std::vector<std::pair<unsigned int, float>> stack;
+        stack.reserve(64);
+        float entry;
+        if (ray_enters(bvh[0], ray, inverse, hit.t, entry))
+            stack.push_back(std::make_pair(0u, entry));
+        bool found = false;
+        while (!stack.empty())
+        {
+            unsigned int n = stack.back().first;
+            entry = stack.back().second;
+            stack.pop_back();
+            if (entry > hit.t)
+                continue;
+            const BvhNode &node = bvh[n];
+            if (node.count > 0)
+            {
+                if (ray_hits_packs(ray, &bvh_packs[node.first], (node.count + 3) / 4, hit))
+                    found = true;
+                continue;
+            }
+
+            float near_entry, far_entry;
+            unsigned int near_child = n + 1, far_child = node.first;
+            bool near_hit = ray_enters(bvh[near_child], ray, inverse, hit.t, near_entry);
+            bool far_hit = ray_enters(bvh[far_child], ray, inverse, hit.t, far_entry);
+            if (near_hit && far_hit && far_entry < near_entry)
+            {
+                std::swap(near_child, far_child);
+                std::swap(near_entry, far_entry);
+            }
+            else if (!near_hit)
+            {
+                near_child = far_child;
+                near_entry = far_entry;
+                near_hit = far_hit;
+                far_hit = false;
+            }
+            if (far_hit)
+                stack.push_back(std::make_pair(far_child, far_entry));
+            if (near_hit)
+                stack.push_back(std::make_pair(near_child, near_entry));
+        }
+        return found;
     }
 
-    uint64_t make_edge_id(unsigned int a, unsigned int b)
+    // Vertices split for their normals share a point, which goes in the tree once
+    void make_point_tree()
     {
-        if (a < b)
-            return ((uint64_t)a << 32) | b;
-        else
-            return ((uint64_t)b << 32) | a;
+        std::vector<unsigned int> leader = position_leaders();
+        point_tree_points.clear();
+        for (size_t v = 0; v < vertices.size(); ++v)
+        {
+            if (leader[v] == v)
+                point_tree_points.push_back(vertices[v]);
+        }
+        leader = std::vector<unsigned int>();
+        if (tasks_cancelled)
+            return;
+        point_tree_points.shrink_to_fit();
+        int depth = 0;
+        while ((size_t)1 << depth < worker_count())
+            ++depth;
+        point_tree.clear();
+        if (!point_tree_points.empty())
+            KdBuilder{ point_tree_points.data(), tasks_cancelled }.build(point_tree, 0, (unsigned int)point_tree_points.size(), depth + 1);
+        if (tasks_cancelled)
+        {
+            point_tree.clear();
+            return;
+        }
+        point_tree.shrink_to_fit();
+        point_tree_ready = true;
+        debug_print("point tree: %zu nodes over %zu points\n", point_tree.size(), point_tree_points.size());
     }
 
-    void make_edges()
+    // Finds the vertex nearest the ray, in mesh coordinates, among those within radius + spread * t
+    // of it at distance t along it and no further along than t_max, with distances along the ray in
+    // lengths of its direction. score is how far out a vertex lies, from 0 on the ray to 1 at the
+    // edge of the cone, and is updated when a vertex lies further in than the score given.
+    bool closest_vertex(const Ray &ray, float radius, float spread, float t_max, float &score, Vector &v)
     {
-        std::unordered_set<uint64_t> edge_ids;
-        for (size_t i = 0; i < triangles.size(); i += 3)
+        if (!point_tree_ready)
         {
-            for (int e = 0; e < 3; ++e)
+            if (point_tree_task.valid())
+                point_tree_task.get();
+            else
+                make_point_tree();
+        }
+        if (point_tree.empty())
+            return false;
+
+        float dd = dot(ray.dir, ray.dir);
+        float length = sqrtf(dd);
+
+        // The least score any vertex in the node can have, judged from the sphere around its box
+        auto bound = [&](const BvhNode &node)
+        {
+            Vector c = { (node.min[0] + node.max[0]) * 0.5f, (node.min[1] + node.max[1]) * 0.5f, (node.min[2] + node.max[2]) * 0.5f };
+            float r = (Vector{ node.max[0], node.max[1], node.max[2] } - c).length();
+            float t = dot(c - ray.pt, ray.dir) / dd;
+            float dt = r / length;
+            if (t + dt < 0.0f || t - dt > t_max)
+                return FLT_MAX;
+            float d = (c - (ray.pt + ray.dir * t)).length() - r;
+            return d <= 0.0f ? 0.0f : d / (radius + spread * (t + dt));
+        };
+
+        std::vector<std::pair<unsigned int, float>> stack;
+        stack.reserve(64);
+        stack.push_back(std::make_pair(0u, bound(point_tree[0])));
+        bool found = false;
+        while (!stack.empty())
+        {
+            unsigned int n = stack.back().first;
+            float least = stack.back().second;
+            stack.pop_back();
+            if (least >= score)
+                continue;
+            const BvhNode &node = point_tree[n];
+            if (node.count > 0)
             {
-                unsigned int v1 = triangles[i + e];
-                unsigned int v2 = triangles[i + (e == 2 ? 0 : e + 1)];
-                uint64_t eid = make_edge_id(v1, v2);
-                if (edge_ids.count(eid) == 0)
+                for (unsigned int i = node.first; i < node.first + node.count; ++i)
                 {
-                    edge_ids.insert(eid);
-                    edges.push_back(v1);
-                    edges.push_back(v2);
+                    const Vector &p = point_tree_points[i];
+                    float t = dot(p - ray.pt, ray.dir) / dd;
+                    if (t < 0.0f || t > t_max)
+                        continue;
+                    float d = (p - (ray.pt + ray.dir * t)).length();
+                    float tolerance = radius + spread * t;
+                    if (d < score * tolerance)
+                    {
+                        score = d / tolerance;
+                        v = p;
+                        found = true;
+                    }
                 }
+                continue;
             }
+
+            // The child that may hold the better vertex is looked at first
+            unsigned int near_child = n + 1, far_child = node.first;
+            float near_least = bound(point_tree[near_child]), far_least = bound(point_tree[far_child]);
+            if (far_least < near_least)
+            {
+                std::swap(near_child, far_child);
+                std::swap(near_least, far_least);
+            }
+            if (far_least < score)
+                stack.push_back(std::make_pair(far_child, far_least));
+            if (near_least < score)
+                stack.push_back(std::make_pair(near_child, near_least));
+        }
+        return found;
+    }
+
+    // Levels of detail with about a quarter of the triangles of the level before, down to a few
+    // thousand. One simplifier run over the position welded mesh makes them all, each level copied
+    // out as the run passes its triangle count. Normals are rebuilt with the crease angle used to load.
+    void make_lods()
+    {
+        std::vector<unsigned int> leader = position_leaders();
+        std::vector<unsigned int> point_of(vertices.size());
+        size_t n_points = 0;
+        for (size_t v = 0; v < vertices.size(); ++v)
+            point_of[v] = leader[v] == v ? (unsigned int)n_points++ : point_of[leader[v]];
+        leader = std::vector<unsigned int>();
+
+        Simplifier simplifier;
+        simplifier.build(vertices, triangles, point_of, n_points);
+        point_of = std::vector<unsigned int>();
+
+        std::vector<std::unique_ptr<Mesh>> levels;
+        size_t previous = simplifier.live_faces;
+        for (size_t target = previous / 4; target >= 4096; target /= 4)
+        {
+            simplifier.simplify(target, tasks_cancelled);
+            // Stop once the surface will not give up many more triangles
+            if (tasks_cancelled || simplifier.live_faces * 4 > previous * 3)
+                break;
+            previous = simplifier.live_faces;
+
+            std::unique_ptr<Mesh> level = std::make_unique<Mesh>();
+            simplifier.extract(level->vertices, level->triangles);
+            level->make_crease_normals(crease_angle);
+            level->finalize();
+            level->lod_error = simplifier.error();
+            debug_print("level of detail %zu: %zu triangles, error %g\n", levels.size() + 1, previous, level->lod_error);
+            levels.push_back(std::move(level));
         }
+        lods.swap(levels);
     }
 
     Vector sphere_pt(float r, float u, float v)
@@ -603,9 +3620,342 @@ struct Mesh
                 sphere_triangle(r, p3, p1, p2, c);
             }
         }
-        make_edges();
+        finalize();
+    }
+};
+
+// A connected part of a loaded mesh, the unit repeats are looked for in
+struct Part
+{
+    size_t mesh;
+    std::vector<unsigned int> faces;
+    std::vector<unsigned int> points;   // position leaders of its corners, each once
+    Box box;
+    uint64_t key;                       // hash of its counts and proportions, equal for translated copies
+};
+
+// A part prepared for quick comparison with others. Points are bucketed relative to the box corner
+// in a grid of cells twice the tolerance, as in merge_close_vertices, and triangles are kept as
+// triples of point numbers starting from the lowest, so the same triangle has one key.
+struct ShapeIndex
+{
+    const Part *part;
+    Vector origin;
+    float tolerance;
+    float cell;
+    std::vector<Vector> point;
+    std::vector<unsigned int> next;     // next point in the same cell
+    std::unordered_map<uint64_t, unsigned int> grid;
+    std::unordered_map<uint64_t, unsigned int> faces;   // triangle key to number of times it appears
+
+    static uint64_t cell_key(int ix, int iy, int iz)
+    {
+        return ((uint64_t)(unsigned int)ix << 42) | ((uint64_t)(unsigned int)iy << 21) | (uint64_t)(unsigned int)iz;
+    }
+
+    // Rounding allowed in the points of a part with this box. Points are compared relative to the
+    // box corner, but they were rounded at the size of their distance from the origin.
+    static float tolerance_for(const Box &b)
+    {
+        float reach = (std::max)(b.size(), (std::max)((std::max)(fabsf(b.xmin), fabsf(b.xmax)),
+                                                      (std::max)((std::max)(fabsf(b.ymin), fabsf(b.ymax)), (std::max)(fabsf(b.zmin), fabsf(b.zmax)))));
+        return (std::max)(reach * 1e-5f, FLT_MIN);
+    }
+
+    static uint64_t face_key(unsigned int a, unsigned int b, unsigned int c)
+    {
+        if (b < a && b < c)
+            std::swap(a, b), std::swap(b, c);
+        else if (c < a && c < b)
+            std::swap(a, c), std::swap(b, c);
+        return ((uint64_t)a << 42) | ((uint64_t)b << 21) | (uint64_t)c;
+    }
+
+    // Point numbers are local to the part, found through local_point of its mesh
+    void build(const Part &p, const Mesh &m, const std::vector<unsigned int> &local_point)
+    {
+        part = &p;
+        origin = Vector{ p.box.xmin, p.box.ymin, p.box.zmin };
+        tolerance = tolerance_for(p.box);
+        for (unsigned int v : p.points)
+            point.push_back(m.vertices[v] - origin);
+        make_grid(tolerance);
+        for (unsigned int f : p.faces)
+        {
+            const unsigned int *t = &m.triangles[f * 3];
+            ++faces[face_key(local_point[t[0]], local_point[t[1]], local_point[t[2]])];
+        }
+    }
+
+    // Buckets the points in cells at least twice tol a side
+    void make_grid(float tol)
+    {
+        cell = (std::max)(tol * 2.0f, part->box.size() / (1 << 20));
+        const unsigned int none = ~0u;
+        grid.clear();
+        next.assign(point.size(), none);
+        for (unsigned int n = 0; n < (unsigned int)point.size(); ++n)
+        {
+            const Vector &q = point[n];
+            auto ins = grid.insert(std::make_pair(cell_key((int)floorf(q.x / cell), (int)floorf(q.y / cell), (int)floorf(q.z / cell)), n));
+            if (!ins.second)
+            {
+                next[n] = ins.first->second;
+                ins.first->second = n;
+            }
+        }
+    }
+
+    // Number of the nearest point within tol of q, relative to the box corner, or none. Up to a
+    // tolerance of half a cell that is two cells a side. The nearest, not the first, so points closer
+    // together than tol still map to their own.
+    unsigned int find(const Vector &q, float tol) const
+    {
+        const unsigned int none = ~0u;
+        unsigned int found = none;
+        float nearest = tol * tol;
+        int x0 = (int)floorf((q.x - tol) / cell), x1 = (int)floorf((q.x + tol) / cell);
+        int y0 = (int)floorf((q.y - tol) / cell), y1 = (int)floorf((q.y + tol) / cell);
+        int z0 = (int)floorf((q.z - tol) / cell), z1 = (int)floorf((q.z + tol) / cell);
+        for (int ix = x0; ix <= x1; ++ix)
+        {
+            for (int iy = y0; iy <= y1; ++iy)
+            {
+                for (int iz = z0; iz <= z1; ++iz)
+                {
+                    auto it = grid.find(cell_key(ix, iy, iz));
+                    if (it == grid.end())
+                        continue;
+                    for (unsigned int r = it->second; r != none; r = next[r])
+                    {
+                        Vector d = point[r] - q;
+                        if (dot(d, d) <= nearest)
+                        {
+                            nearest = dot(d, d);
+                            found = r;
+                        }
+                    }
+                }
+            }
+        }
+        return found;
+    }
+
+    // True if other, from mesh m, is this part moved: each of its points lands on one here and its
+    // triangles on the same triangles here. Either part may be the one further out and so the more
+    // coarsely rounded; the cells grow to suit a coarser one.
+    bool matches(const Part &other, const Mesh &m, const std::vector<unsigned int> &local_point)
+    {
+        if (other.faces.size() != part->faces.size() || other.points.size() != point.size())
+            return false;
+        Vector other_origin = { other.box.xmin, other.box.ymin, other.box.zmin };
+        float tol = (std::max)(tolerance, tolerance_for(other.box));
+        if (tol * 2.0f > cell)
+            make_grid(tol);
+        std::vector<unsigned int> mapped(other.points.size());
+        for (size_t i = 0; i < other.points.size(); ++i)
+        {
+            mapped[i] = find(m.vertices[other.points[i]] - other_origin, tol);
+            if (mapped[i] == ~0u)
+                return false;
+        }
+        std::unordered_map<uint64_t, unsigned int> seen;
+        seen.reserve(faces.size());
+        for (unsigned int f : other.faces)
+        {
+            const unsigned int *t = &m.triangles[f * 3];
+            uint64_t key = face_key(mapped[local_point[t[0]]], mapped[local_point[t[1]]], mapped[local_point[t[2]]]);
+            auto it = faces.find(key);
+            if (it == faces.end() || ++seen[key] > it->second)
+                return false;
+        }
+        return true;
+    }
+};
+
+// Splits the meshes into connected parts and finds parts that repeat, moved but not turned, to be
+// drawn as one mesh with an instance at each place. Candidates share a key made from their counts
+// and proportions and are then checked point by point, so copies written with slightly different
+// rounding still match. The shared meshes, and copies of the searched meshes holding whatever does
+// not repeat, go in added, and replaced marks the searched meshes they stand in for. Only reads the
+// meshes, so it can run while they are drawn. Returns false if nothing repeats or it was cancelled.
+static bool instance_duplicates(const std::vector<Mesh *> &meshes, const std::atomic<bool> &cancelled,
+    std::vector<std::unique_ptr<Mesh>> &added, std::vector<bool> &replaced)
+{
+    std::vector<std::vector<unsigned int>> local_point(meshes.size());
+    std::vector<Part> parts;
+    for (size_t i = 0; i < meshes.size(); ++i)
+    {
+        if (cancelled)
+            return false;
+        const Mesh &m = *meshes[i];
+        std::vector<unsigned int> leader = m.position_leaders();
+        std::vector<unsigned int> &local = local_point[i];
+        local.assign(m.vertices.size(), ~0u);
+        std::vector<std::vector<unsigned int>> components = m.connected_faces(leader);
+        std::vector<size_t> big;
+        for (size_t j = 0; j < components.size(); ++j)
+        {
+            if (components[j].size() >= instance_min_triangles)
+                big.push_back(j);
+        }
+
+        // Parts hold distinct points, so each can gather its own in parallel
+        std::vector<Part> mesh_parts(big.size());
+        size_t n_chunks = (std::max)((size_t)1, (std::min)(worker_count() * 4, big.size() / 16));
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, big.size());
+            for (size_t j = chunk_begin(c, n_chunks, big.size()); j < end; ++j)
+            {
+                Part &p = mesh_parts[j];
+                p.mesh = i;
+                p.faces.swap(components[big[j]]);
+                for (unsigned int f : p.faces)
+                {
+                    for (int k = 0; k < 3; ++k)
+                    {
+                        unsigned int v = leader[m.triangles[f * 3 + k]];
+                        const Vector &pt = m.vertices[v];
+                        Box b = { pt.x, pt.x, pt.y, pt.y, pt.z, pt.z };
+                        if (p.points.empty())
+                            p.box = b;
+                        else
+                            p.box += b;
+                        if (local[v] == ~0u)
+                        {
+                            local[v] = (unsigned int)p.points.size();
+                            p.points.push_back(v);
+                        }
+                    }
+                }
+
+                // Proportions to 1/256 of the longest side stand up to the rounding of a moved copy
+                float size = (std::max)(p.box.size(), FLT_MIN);
+                uint64_t qx = (uint64_t)((p.box.xmax - p.box.xmin) / size * 256.0f + 0.5f);
+                uint64_t qy = (uint64_t)((p.box.ymax - p.box.ymin) / size * 256.0f + 0.5f);
+                uint64_t qz = (uint64_t)((p.box.zmax - p.box.zmin) / size * 256.0f + 0.5f);
+                uint64_t h = p.faces.size() * 0x9e3779b97f4a7c15ull ^ p.points.size() * 0xc2b2ae3d27d4eb4full ^ (qx | qy << 10 | qz << 20) * 0x165667b19e3779f9ull;
+                h ^= h >> 33;
+                h *= 0xff51afd7ed558ccdull;
+                h ^= h >> 33;
+                p.key = h;
+            }
+        });
+        components = std::vector<std::vector<unsigned int>>();
+
+        // Triangle keys hold point numbers in 21 bits
+        for (Part &p : mesh_parts)
+        {
+            if (p.points.size() < (1u << 21))
+                parts.push_back(std::move(p));
+        }
+
+        n_chunks = (std::max)((size_t)1, (std::min)(worker_count() * 4, m.vertices.size() / 65536));
+        parallel_for(n_chunks, [&](size_t c)
+        {
+            size_t end = chunk_begin(c + 1, n_chunks, m.vertices.size());
+            for (size_t v = chunk_begin(c, n_chunks, m.vertices.size()); v < end; ++v)
+            {
+                if (leader[v] != v)
+                    local[v] = local[leader[v]];
+            }
+        });
+    }
+
+    // A single part, the usual scan, has nothing to repeat
+    if (parts.size() < 2)
+        return false;
+
+    std::unordered_map<uint64_t, std::vector<size_t>> parts_by_key;
+    for (size_t i = 0; i < parts.size(); ++i)
+        parts_by_key[parts[i].key].push_back(i);
+
+    // Each shape heads a group of the parts found to be copies of it. Parts alone under their key
+    // have no copies and are not indexed.
+    std::vector<std::unique_ptr<ShapeIndex>> shapes;
+    std::vector<std::vector<size_t>> copies;
+    for (const auto &same_key : parts_by_key)
+    {
+        if (same_key.second.size() < 2)
+            continue;
+        if (cancelled)
+            return false;
+        size_t first_shape = shapes.size();
+        for (size_t i : same_key.second)
+        {
+            const Part &p = parts[i];
+            size_t s = first_shape;
+            while (s < shapes.size() && !shapes[s]->matches(p, *meshes[p.mesh], local_point[p.mesh]))
+                ++s;
+            if (s == shapes.size())
+            {
+                shapes.push_back(std::make_unique<ShapeIndex>());
+                shapes.back()->build(p, *meshes[p.mesh], local_point[p.mesh]);
+                copies.emplace_back();
+            }
+            copies[s].push_back(i);
+        }
+    }
+
+    std::vector<std::vector<bool>> moved(meshes.size());
+    std::vector<std::unique_ptr<Mesh>> shared;
+    size_t n_instances = 0;
+    for (size_t s = 0; s < shapes.size(); ++s)
+    {
+        if (copies[s].size() < 2)
+            continue;
+        if (cancelled)
+            return false;
+        const Part &first = *shapes[s]->part;
+        std::unique_ptr<Mesh> m = std::make_unique<Mesh>();
+        m->copy_faces(*meshes[first.mesh], first.faces, shapes[s]->origin);
+        for (size_t i : copies[s])
+        {
+            const Part &p = parts[i];
+            Instance instance;
+            mat4x4_translate(instance.transform, p.box.xmin, p.box.ymin, p.box.zmin);
+            instance.color = meshes[p.mesh]->color;
+            m->instances.push_back(instance);
+
+            std::vector<bool> &faces_moved = moved[p.mesh];
+            faces_moved.resize(meshes[p.mesh]->triangles.size() / 3);
+            for (unsigned int f : p.faces)
+                faces_moved[f] = true;
+        }
+        n_instances += copies[s].size();
+        shared.push_back(std::move(m));
     }
-};
+    if (shared.empty())
+        return false;
+
+    // Meshes that lost parts are rebuilt from the triangles left over
+    added.clear();
+    replaced.assign(meshes.size(), false);
+    for (size_t i = 0; i < meshes.size(); ++i)
+    {
+        if (moved[i].empty())
+            continue;
+        if (cancelled)
+            return false;
+        replaced[i] = true;
+        std::vector<unsigned int> rest;
+        for (size_t f = 0; f < moved[i].size(); ++f)
+        {
+            if (!moved[i][f])
+                rest.push_back((unsigned int)f);
+        }
+        if (rest.empty())
+            continue;
+        std::unique_ptr<Mesh> m = std::make_unique<Mesh>();
+        m->copy_faces(*meshes[i], rest, Vector{ 0.0f, 0.0f, 0.0f });
+        added.push_back(std::move(m));
+    }
+    for (auto &m : shared)
+        added.push_back(std::move(m));
+    debug_print("instances: %zu parts drawn as %zu shared meshes\n", n_instances, shared.size());
+    return true;
+}
 
 //========================================================================
 // Draw scene
@@ -618,6 +3968,137 @@ static void print_matrix(const char *msg, mat4x4 m)
         debug_print("%g %g %g %g\n", m[i][0], m[i][1], m[i][2], m[i][3]);
 }
 
+// Per vertex lighting matching what the fixed function pipeline did: one point light given in eye space,
+// ambient from the light model and the light (0.2 each), diffuse 0.8 and the mesh color as the material
+static const char *mesh_vertex_shader = R"(#version 330 core
+layout(std140) uniform Camera
+{
+    mat4 modelview;
+    mat4 projection;
+    vec4 light_position;
+};
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 normal;
+uniform samplerBuffer instances;
+out vec3 shade;
+void main()
+{
+    int base = gl_InstanceID * 5;
+    mat4 model = mat4(texelFetch(instances, base), texelFetch(instances, base + 1),
+                      texelFetch(instances, base + 2), texelFetch(instances, base + 3));
+    vec3 color = texelFetch(instances, base + 4).rgb;
+    vec4 eye = modelview * (model * vec4(position, 1.0));
+    vec3 n = mat3(modelview) * (mat3(model) * normal);
+    vec3 l = normalize(light_position.xyz - eye.xyz);
+    float diffuse = dot(n, n) > 0.0 ? max(dot(normalize(n), l), 0.0) : 0.0;
+    shade = min(color * (0.4 + 0.8 * diffuse), 1.0);
+    gl_Position = projection * eye;
+}
+)";
+
+static const char *mesh_fragment_shader = R"(#version 330 core
+in vec3 shade;
+out vec4 frag_color;
+void main()
+{
+    frag_color = vec4(shade, 1.0);
+}
+)";
+
+// The ID pass places vertices as the mesh shader does and writes the object, instance and triangle
+// numbers of each fragment, 0 for the object meaning none
+static const char *id_vertex_shader = R"(#version 330 core
+layout(std140) uniform Camera
+{
+    mat4 modelview;
+    mat4 projection;
+    vec4 light_position;
+};
+layout(location = 0) in vec3 position;
+uniform samplerBuffer instances;
+flat out uint instance_number;
+void main()
+{
+    int base = gl_InstanceID * 5;
+    mat4 model = mat4(texelFetch(instances, base), texelFetch(instances, base + 1),
+                      texelFetch(instances, base + 2), texelFetch(instances, base + 3));
+    instance_number = uint(texelFetch(instances, base + 4).a);
+    gl_Position = projection * (modelview * (model * vec4(position, 1.0)));
+}
+)";
+
+static const char *id_fragment_shader = R"(#version 330 core
+uniform uint object;
+flat in uint instance_number;
+out uvec4 id;
+void main()
+{
+    id = uvec4(object, instance_number, uint(gl_PrimitiveID), 0u);
+}
+)";
+
+// Matches the std140 layout of the Camera uniform block
+struct CameraBlock
+{
+    mat4x4 modelview;
+    mat4x4 projection;
+    float light_position[4];
+};
+
+static_assert(sizeof(CameraBlock) == 144, "std140 Camera block is two mat4 and a vec4");
+
+static const GLuint camera_binding = 0;
+
+static GLuint compile_shader(GLenum type, const char *source)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, nullptr);
+    glCompileShader(shader);
+
+    GLint status;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (!status)
+    {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+        debug_print("shader compile failed: %s\n", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+static GLuint link_program(const char *vertex_source, const char *fragment_source)
+{
+    GLuint vertex = compile_shader(GL_VERTEX_SHADER, vertex_source);
+    GLuint fragment = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+    if (vertex == 0 || fragment == 0)
+    {
+        glDeleteShader(vertex);
+        glDeleteShader(fragment);
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex);
+    glAttachShader(program, fragment);
+    glLinkProgram(program);
+    glDeleteShader(vertex);
+    glDeleteShader(fragment);
+
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (!status)
+    {
+        char log[1024];
+        glGetProgramInfoLog(program, sizeof(log), nullptr, log);
+        debug_print("shader link failed: %s\n", log);
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
 struct Scene
 {
     GLFWwindow *window;
@@ -626,13 +4107,44 @@ struct Scene
     Vector center;
     float scale = 1.0f;
     bool perspective = true;
+    int viewport_height = 1;
+
+    // Frames drawn while dragging are held to frame_budget seconds using the measured drawing rate,
+    // and full detail comes back once the view has been still for settle_time seconds
+    double frame_budget = 1.0 / 60.0;
+    double settle_time = 0.2;
+    double primitives_per_second = 0.0;
+    int frames_since_sample = 0;    // interactive frames drawn since the rate was last measured
+    double last_draw_time = 0.0;
+    bool proxy_shown = false;
     double mouse_down_x, mouse_down_y;
     bool dragged = false;
     bool wireframe = false;
+    bool features = false;  // wireframe shows feature edges only
+    bool cull = true;       // skip clusters outside the view or facing away
+
+    // Hover picking reads out the surface under the cursor as it moves, picking at most once a pass
+    // of the event loop and not until every mesh's hierarchy is built
+    bool hover = false;
+    bool hover_pending = false;
+    double hover_x, hover_y;
+    std::string hover_message;
+
+    // With snap on, picks land on the mesh vertex nearest the cursor if one is within snap_pixels
+    bool snap = false;
+    float snap_pixels = 8.0f;
 
     std::vector<std::unique_ptr<Mesh>> m_objects;
-    Mesh *m_indicator1;
-    Mesh *m_indicator2;
+    Mesh *m_indicator;      // the pick markers, one instance each
+
+    // The search for repeated parts runs in the background after loading, and the meshes it makes
+    // are swapped in by finish_instancing. Edges and levels of detail wait for it.
+    std::vector<Mesh *> instancing_input;
+    std::vector<std::unique_ptr<Mesh>> instancing_added;
+    std::vector<bool> instancing_replaced;
+    std::atomic<bool> instancing_ready{ false };
+    std::atomic<bool> instancing_cancelled{ false };
+    std::future<bool> instancing_task;
     Vector m_pick1;
     Vector m_pick2;
     int m_nextPick = 1;
@@ -643,37 +4155,112 @@ struct Scene
     std::string message3;
     CBitmapFont font;
 
-    void draw();
+    GLuint program = 0;
+    GLuint camera_buffer = 0;
+
+    // With gpu_pick on, picks read the surface under the cursor back from an offscreen ID pass
+    // instead of casting a ray, so they see whatever level of detail the frame drew
+    bool gpu_pick = false;
+    GLuint id_program = 0;
+    GLint id_object_location = -1;
+    GLuint id_framebuffer = 0;
+    GLuint id_color = 0;
+    GLuint id_depth = 0;
+    int id_width = 0;
+    int id_height = 0;
+
+    void draw(bool interactive);
     void init_opengl();
+    void release_opengl();
     void key_callback(int key, int scancode, int action, int mods);
     void mouse_button_callback(int button, int action, int mods);
     void cursor_position_callback(double mouse_x, double mouse_y);
+    Ray pick_ray(double mouse_x, double mouse_y);
     bool pick(double mouse_x, double mouse_y, Vector &v);
+    bool pick_ids(double mouse_x, double mouse_y, Vector &v);
+    void hover_pick();
     void scroll_callback(double x, double y);
     void set_projection();
-    bool fire_point(const Ray &ray, Vector &v);
+    bool fire_point(const Ray &ray, float radius, float spread, float t_max, Vector &v);
     bool fire_line(const Ray &ray, Vector &v);
     void autoscale();
     void make_indicator(int no, const Vector &pos);
     void clear();
+    void start_instancing();
+    void finish_instancing();
+    float pixel_size(Mesh &m);
 };
 
 static Scene scene;
 
 void Scene::clear()
 {
+    redraw_needed = true;
+    if (instancing_task.valid())
+    {
+        instancing_cancelled = true;
+        instancing_task.get();
+        instancing_cancelled = false;
+        instancing_ready = false;
+        instancing_added.clear();
+    }
     m_objects.clear();
-    m_indicator1 = nullptr;
-    m_indicator2 = nullptr;
+    m_indicator = nullptr;
     message1.clear();
     message2.clear();
     message3.clear();
+    hover_message.clear();
     m_nextPick = 1;
     m_pickCount = 0;
 }
 
+void Scene::start_instancing()
+{
+    if (!find_duplicates || instancing_task.valid())
+        return;
+    instancing_input.clear();
+    for (const auto &m : m_objects)
+    {
+        if (m->include_in_scene_box && m->instances.empty())
+            instancing_input.push_back(m.get());
+    }
+    if (instancing_input.empty())
+        return;
+    instancing_task = std::async(std::launch::async, [this]()
+    {
+        bool found = instance_duplicates(instancing_input, instancing_cancelled, instancing_added, instancing_replaced);
+        instancing_ready = true;
+        glfwPostEmptyEvent();
+        return found;
+    });
+}
+
+// Swaps in the meshes the background search made, once it is done
+void Scene::finish_instancing()
+{
+    if (!instancing_task.valid() || !instancing_ready)
+        return;
+    instancing_ready = false;
+    redraw_needed = true;
+    if (!instancing_task.get())
+        return;
+
+    std::vector<std::unique_ptr<Mesh>> kept;
+    for (auto &m : m_objects)
+    {
+        auto it = std::find(instancing_input.begin(), instancing_input.end(), m.get());
+        if (it == instancing_input.end() || !instancing_replaced[it - instancing_input.begin()])
+            kept.push_back(std::move(m));
+    }
+    for (auto &m : instancing_added)
+        kept.push_back(std::move(m));
+    instancing_added.clear();
+    m_objects.swap(kept);
+}
+
 void Scene::autoscale()
 {
+    redraw_needed = true;
     scale = 1.0f;
     center = { 0.0f, 0.0f, 0.0f };
 
@@ -687,29 +4274,23 @@ void Scene::autoscale()
                 continue;
             if (first)
             {
-                b = m_objects[i]->model_box();
+                b = m_objects[i]->world_box();
                 first = false;
             }
             else
-                b += m_objects[i]->model_box();
+                b += m_objects[i]->world_box();
         }
         scale = 2.0f / b.size();
         center = b.center();
     }
 }
 
-void Scene::draw()
+// Interactive frames may trade detail for speed, see Mesh::render
+void Scene::draw(bool interactive)
 {
-    GLfloat mat_ambient_color[] = { 0.8f, 0.8f, 0.8f, 1.0f };
-
+    double start = glfwGetTime();
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
-
-    GLfloat position[] = { 1.0f, 1.0f, perspective ? 0.0f : 3.0f, 1.0f };
-    glLightfv(GL_LIGHT0, GL_POSITION, position);
-
 #if 0
     // Move back
     glTranslatef(0.0, 0.0, -zoom);
@@ -730,25 +4311,110 @@ void Scene::draw()
     mat4x4_rotate_Z(modelview, modelview, alpha / 180.0f * (float)M_PI);
     mat4x4_translate_in_place(modelview, -center.x, -center.y, -center.z);
 
-    glLoadMatrixf((const GLfloat *)modelview);
+    // The light sits in eye space so it moves with the viewer
+    CameraBlock camera;
+    mat4x4_dup(camera.modelview, modelview);
+    mat4x4_dup(camera.projection, projection);
+    camera.light_position[0] = 1.0f;
+    camera.light_position[1] = 1.0f;
+    camera.light_position[2] = perspective ? 0.0f : 3.0f;
+    camera.light_position[3] = 1.0f;
+    glBindBuffer(GL_UNIFORM_BUFFER, camera_buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(camera), &camera);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    // Each mesh gets a share of the frame's primitives in proportion to its triangles
+    size_t total = 0;
+    for (const auto &m : m_objects)
+        total += m->triangles.size() / 3 * m->instance_count();
+    double budget = interactive && primitives_per_second > 0.0 ? 0.8 * primitives_per_second * frame_budget : 0.0;
 
-    //glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, mat_ambient_color);
+    ViewVolume view;
+    view.set(projection, modelview, perspective);
+    view.cull = cull;
 
+    size_t drawn = 0;
+    glUseProgram(program);
     for (const auto &m : m_objects)
-        m->render(wireframe);
+    {
+        size_t share = SIZE_MAX;
+        if (budget > 0.0)
+            share = (size_t)(std::max)(budget * (m->triangles.size() / 3 * m->instance_count()) / (std::max)(total, (size_t)1), 1000.0);
+        drawn += m->render(wireframe, features, pixel_size(*m), share, view);
+    }
+    glUseProgram(0);
+
+    // Time the meshes alone so the rate is not held down by waiting for vertical sync. Waiting for
+    // the GPU stops the next frame being recorded while this one draws, so a drag only measures
+    // every sample_interval frames, and still frames, where nothing follows at once, always do.
+    const int sample_interval = 16;
+    if (drawn >= 10000 && (!interactive || primitives_per_second == 0.0 || ++frames_since_sample >= sample_interval))
+    {
+        glFinish();
+        double elapsed = glfwGetTime() - start;
+        if (elapsed > 0.0)
+        {
+            double rate = drawn / elapsed;
+            primitives_per_second = primitives_per_second > 0.0 ? 0.7 * primitives_per_second + 0.3 * rate : rate;
+        }
+        frames_since_sample = 0;
+    }
+    proxy_shown = interactive;
 
-    if (!message1.empty() || !message2.empty() || !message3.empty())
+    if (!message1.empty() || !message2.empty() || !message3.empty() || !hover_message.empty())
     {
-        GLfloat ambientLight1[] = { 0.2f, 0.2f, 0.2f, 1.0f };
-        GLfloat ambientLight2[] = { 1.0f, 1.0f, 1.0f, 1.0f };
-        glLightfv(GL_LIGHT0, GL_AMBIENT, ambientLight2);
+        font.ezPrint(hover_message.c_str(), 5, 65);
         font.ezPrint(message1.c_str(), 5, 45);
         font.ezPrint(message2.c_str(), 5, 25);
         font.ezPrint(message3.c_str(), 5, 5);
-        glLightfv(GL_LIGHT0, GL_AMBIENT, ambientLight1);
     }
 
     glfwSwapBuffers(window);
+    last_draw_time = glfwGetTime();
+
+    // The view may have moved under a still cursor
+    if (hover && !interactive)
+        hover_pending = true;
+
+    // Now the solid view is up, work out the wireframe edges behind it, unless the meshes may yet
+    // be replaced by instances
+    for (const auto &m : m_objects)
+    {
+        if (instancing_task.valid())
+            break;
+        m->start_edges();
+        if (features)
+            m->start_feature_edges();
+        m->start_lods();
+    }
+}
+
+// Model units covered by a pixel at the point of the mesh's bounding sphere nearest the eye
+float Scene::pixel_size(Mesh &m)
+{
+    float s = scale;
+    if (!perspective)
+        return 2.0f / (viewport_height * s * zoom / 8.0f);
+
+    // The nearest instance decides, measured in the mesh's own units
+    Box b = m.model_box();
+    Vector c = b.center();
+    Vector corner = { b.xmax, b.ymax, b.zmax };
+    float radius = (corner - c).length();
+    float size = FLT_MAX;
+    for (size_t i = 0; i < m.instance_count(); ++i)
+    {
+        mat4x4 t;
+        m.instance_transform(i, t);
+        float instance_scale = transform_scale(t);
+        Vector p = transform_point(t, c);
+        vec4 model = { p.x, p.y, p.z, 1.0f };
+        vec4 eye;
+        mat4x4_mul_vec4(eye, modelview, model);
+        float distance = (std::max)(-eye[2] - radius * instance_scale * s, 1.0f);
+        size = (std::min)(size, 2.0f * distance * tanf(30.0f * (float)M_PI / 180.0f) / (viewport_height * s * instance_scale));
+    }
+    return size;
 }
 
 
@@ -758,35 +4424,34 @@ void Scene::draw()
 
 void Scene::init_opengl()
 {
-    // Create light components
-    GLfloat ambientLight[] = { 0.2f, 0.2f, 0.2f, 1.0f };
-    GLfloat diffuseLight[] = { 0.8f, 0.8f, 0.8f, 1.0f };
-    GLfloat specularLight[] = { 0.5f, 0.5f, 0.5f, 1.0f };
-    GLfloat position[] = { 1.0f, 1.0f, 0.0f, 1.0f };
-
-    // Assign created components to GL_LIGHT0
-    glLightfv(GL_LIGHT0, GL_AMBIENT, ambientLight);
-    glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuseLight);
-    glLightfv(GL_LIGHT0, GL_SPECULAR, specularLight);
-    //glLightfv(GL_LIGHT0, GL_POSITION, position);
-
-    glEnable(GL_LIGHTING);
-    glEnable(GL_LIGHT0);
-
-    // Use Gouraud (smooth) shading
-    glShadeModel(GL_SMOOTH);
+    // Lighting is done in the mesh shader, which reads the matrices and light from the camera block
+    program = link_program(mesh_vertex_shader, mesh_fragment_shader);
+    if (program == 0)
+        debug_print("no mesh program, nothing will be drawn\n");
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "instances"), instance_unit);
+    glUseProgram(0);
+    glUniformBlockBinding(program, glGetUniformBlockIndex(program, "Camera"), camera_binding);
+
+    id_program = link_program(id_vertex_shader, id_fragment_shader);
+    if (id_program == 0)
+        debug_print("no ID program, picking casts rays only\n");
+    glUseProgram(id_program);
+    glUniform1i(glGetUniformLocation(id_program, "instances"), instance_unit);
+    id_object_location = glGetUniformLocation(id_program, "object");
+    glUseProgram(0);
+    glUniformBlockBinding(id_program, glGetUniformBlockIndex(id_program, "Camera"), camera_binding);
+
+    glGenBuffers(1, &camera_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, camera_buffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(CameraBlock), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, camera_binding, camera_buffer);
 
     // Switch on the z-buffer
     glEnable(GL_DEPTH_TEST);
-    glEnable(GL_COLOR_MATERIAL);
-    glEnable(GL_RESCALE_NORMAL);
-
-    glEnableClientState(GL_VERTEX_ARRAY);
-    glEnableClientState(GL_NORMAL_ARRAY);
 
-    //glEnableClientState(GL_COLOR_ARRAY);
-    //glVertexPointer(3, GL_FLOAT, sizeof(struct Vertex), vertex);
-    //glColorPointer(3, GL_FLOAT, sizeof(struct Vertex), &vertex[0].r); // Pointer to the first color
+    // Vertex arrays are set up per mesh in Mesh::upload
 
     //glPointSize(2.0);
 
@@ -794,6 +4459,21 @@ void Scene::init_opengl()
     glClearColor(0.2f, 0.2f, 0.4f, 0.f);
 }
 
+// Deletes what init_opengl, the ID pass and the font made, while the context is still alive
+void Scene::release_opengl()
+{
+    font.Release();
+    glDeleteProgram(program);
+    glDeleteProgram(id_program);
+    glDeleteBuffers(1, &camera_buffer);
+    glDeleteFramebuffers(1, &id_framebuffer);
+    GLuint renderbuffers[] = { id_color, id_depth };
+    glDeleteRenderbuffers(2, renderbuffers);
+    program = id_program = camera_buffer = 0;
+    id_framebuffer = id_color = id_depth = 0;
+    id_width = id_height = 0;
+}
+
 
 //========================================================================
 // Print errors
@@ -860,9 +4540,30 @@ void Scene::key_callback(int key, int scancode, int action, int mods)
         case GLFW_KEY_W:
             wireframe = !wireframe;
             break;
-        default:
+        case GLFW_KEY_F:
+            features = !features;
             break;
+        case GLFW_KEY_C:
+            cull = !cull;
+            break;
+        case GLFW_KEY_G:
+            gpu_pick = !gpu_pick;
+            hover_pending = hover;
+            break;
+        case GLFW_KEY_V:
+            snap = !snap;
+            hover_pending = hover;
+            break;
+        case GLFW_KEY_H:
+            hover = !hover;
+            hover_pending = hover;
+            glfwGetCursorPos(window, &hover_x, &hover_y);
+            hover_message.clear();
+            break;
+        default:
+            return;
     }
+    redraw_needed = true;
 }
 
 //========================================================================
@@ -876,22 +4577,23 @@ static void mouse_button_callback(GLFWwindow* window, int button, int action, in
 
 void Scene::make_indicator(int no, const Vector &pos)
 {
-    if ((no == 1 && m_indicator1 == nullptr) || (no == 2 && m_indicator2 == nullptr))
+    // The sphere is built once and each marker is an instance of it moved to its pick
+    if (m_indicator == nullptr)
     {
         std::unique_ptr<Mesh> m = std::make_unique<Mesh>();
+        m->make_sphere(0.5f, Vector{ 0.0f, 0.0f, 0.0f });
+        m->include_in_scene_box = false;
+        m_indicator = m.get();
         m_objects.push_back(std::move(m));
-        if (no == 1)
-            m_indicator1 = m_objects.back().get();
-        else
-            m_indicator2 = m_objects.back().get();
     }
 
-    Mesh *mesh = no == 1 ? m_indicator1 : m_indicator2;
-
-    mesh->clear();
-    mesh->make_sphere(0.5f, pos);
-    mesh->color = Color{ 0.8f, 0.8f, 0.8f };
-    mesh->include_in_scene_box = false;
+    Instance marker;
+    mat4x4_translate(marker.transform, pos.x, pos.y, pos.z);
+    marker.color = Color{ 0.8f, 0.8f, 0.8f };
+    if (m_indicator->instances.size() < (size_t)no)
+        m_indicator->instances.resize(no, marker);
+    m_indicator->instances[no - 1] = marker;
+    redraw_needed = true;
 }
 
 void Scene::mouse_button_callback(int button, int action, int mods)
@@ -910,6 +4612,7 @@ void Scene::mouse_button_callback(int button, int action, int mods)
     else
     {
         glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+        redraw_needed = true;
         double x, y;
         glfwGetCursorPos(window, &x, &y);
         debug_print("down %g %g up %g %g\n", mouse_down_x, mouse_down_y, x, y);
@@ -918,6 +4621,7 @@ void Scene::mouse_button_callback(int button, int action, int mods)
             Vector c;
             if (pick(x, y, c))
             {
+                debug_print("nearest %g %g %g\n", c.x, c.y, c.z);
                 ++m_pickCount;
 
                 char buf[256];
@@ -947,6 +4651,7 @@ void Scene::mouse_button_callback(int button, int action, int mods)
             }
             else
             {
+                debug_print("no nearest\n");
                 message2.clear();
                 message3.clear();
             }
@@ -961,22 +4666,30 @@ static void cursor_position_callback(GLFWwindow* window, double mouse_x, double
 
 void Scene::cursor_position_callback(double mouse_x, double mouse_y)
 {
-    //Vector v;
-    //pick(mouse_x, mouse_y, v);
-
-    if (glfwGetInputMode(window, GLFW_CURSOR) == GLFW_CURSOR_DISABLED)
+    if (glfwGetInputMode(window, GLFW_CURSOR) != GLFW_CURSOR_DISABLED)
+    {
+        if (hover)
+        {
+            hover_x = mouse_x;
+            hover_y = mouse_y;
+            hover_pending = true;
+        }
+    }
+    else
     {
         if (std::abs(mouse_x - cursorX) > 5.f || std::abs(mouse_y - cursorY) > 5.f)
             dragged = true;
         alpha += (GLfloat) (mouse_x - cursorX) / 10.f;
         beta += (GLfloat) (mouse_y - cursorY) / 10.f;
+        redraw_needed = true;
 
         cursorX = mouse_x;
         cursorY = mouse_y;
     }
 }
 
-bool Scene::pick(double mouse_x, double mouse_y, Vector &v)
+// The ray through the cursor, starting on the near plane and pointing into the scene
+Ray Scene::pick_ray(double mouse_x, double mouse_y)
 {
     int width;
     int height;
@@ -1015,7 +4728,7 @@ bool Scene::pick(double mouse_x, double mouse_y, Vector &v)
         b.x = nearPt[0];
         b.y = nearPt[1];
         b.z = nearPt[2];
-        r = { a, (a - b).normalize() };
+        r = { b, (a - b).normalize() };
     }
     else
     {
@@ -1025,104 +4738,250 @@ bool Scene::pick(double mouse_x, double mouse_y, Vector &v)
         mat4x4_mul_vec4(dir, mv_inverse, dir);
         r = { { nearPt[0], nearPt[1], nearPt[2] }, Vector{ dir[0], dir[1], dir[2] }.normalize() };
     }
-    return fire_line(r, v);
+    return r;
 }
 
-bool Scene::fire_point(const Ray &ray, Vector &v)
+bool Scene::pick(double mouse_x, double mouse_y, Vector &v)
 {
-    Vector nearest;
-    float dist = FLT_MAX;
-    bool first = true;
+    Ray r = pick_ray(mouse_x, mouse_y);
+    Vector surface;
+    bool hit = gpu_pick ? pick_ids(mouse_x, mouse_y, surface) : fire_line(r, surface);
+    if (snap)
+    {
+        // The ray snap_pixels to the side gives how far the snapping distance reaches at any depth,
+        // and vertices hidden well behind the surface hit are passed over
+        Ray side = pick_ray(mouse_x + snap_pixels, mouse_y);
+        float radius = (side.pt - r.pt).length();
+        float spread = (side.dir - r.dir).length();
+        float t_max = FLT_MAX;
+        if (hit)
+        {
+            float t = r.distance_along(surface);
+            t_max = t + radius + spread * t;
+        }
+        if (fire_point(r, radius, spread, t_max, v))
+            return true;
+    }
+    if (hit)
+        v = surface;
+    return hit;
+}
 
-    for (const auto &m : m_objects)
+// Draws the scene into the ID target with the matrices of the last frame, but only the pixel under
+// the cursor, and reads back what lies there. The point is where the pick ray meets the triangle
+// found. A triangle narrower than a pixel may cover the pixel's middle, which is what the ID pass
+// sampled, without lying under the cursor, so the ray through the middle is tried next, and failing
+// that the depth found is taken back through the same inverse matrices as the pick ray.
+bool Scene::pick_ids(double mouse_x, double mouse_y, Vector &v)
+{
+    if (id_program == 0)
+        return false;
+
+    int width;
+    int height;
+    glfwGetWindowSize(window, &width, &height);
+    if (width <= 0 || height <= 0)
+        return false;
+    if (width != id_width || height != id_height)
     {
-        if (!m->include_in_scene_box)
+        if (id_framebuffer == 0)
+        {
+            glGenFramebuffers(1, &id_framebuffer);
+            glGenRenderbuffers(1, &id_color);
+            glGenRenderbuffers(1, &id_depth);
+        }
+        glBindRenderbuffer(GL_RENDERBUFFER, id_color);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA32UI, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, id_depth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, id_framebuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, id_color);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, id_depth);
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        if (status != GL_FRAMEBUFFER_COMPLETE)
+        {
+            debug_print("ID framebuffer incomplete: %x\n", status);
+            return false;
+        }
+        id_width = width;
+        id_height = height;
+    }
+
+    int px = (std::min)((std::max)((int)mouse_x, 0), width - 1);
+    int py = (std::min)((std::max)(height - 1 - (int)mouse_y, 0), height - 1);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, id_framebuffer);
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(px, py, 1, 1);
+    const GLuint no_id[4] = { 0, 0, 0, 0 };
+    const GLfloat far_depth = 1.0f;
+    glClearBufferuiv(GL_COLOR, 0, no_id);
+    glClearBufferfv(GL_DEPTH, 0, &far_depth);
+
+    // Each mesh draws the level a still frame would, all of it in one call, so triangle numbers count
+    // from the start of that level
+    ViewVolume view;
+    view.set(projection, modelview, perspective);
+    glUseProgram(id_program);
+    for (size_t i = 0; i < m_objects.size(); ++i)
+    {
+        Mesh &m = *m_objects[i];
+        if (!m.include_in_scene_box)
             continue;
-        for (const auto &pt : m->vertices)
+        glUniform1ui(id_object_location, (GLuint)(i + 1));
+        m.render(false, false, pixel_size(m), SIZE_MAX, view);
+    }
+    glUseProgram(0);
+
+    GLuint id[4];
+    GLfloat depth;
+    glReadPixels(px, py, 1, 1, GL_RGBA_INTEGER, GL_UNSIGNED_INT, id);
+    glReadPixels(px, py, 1, 1, GL_DEPTH_COMPONENT, GL_FLOAT, &depth);
+    glDisable(GL_SCISSOR_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (id[0] == 0 || id[0] > m_objects.size())
+        return false;
+
+    // The triangle numbers count in the level drawn, in the coordinates of the instance
+    Mesh &m = *m_objects[id[0] - 1];
+    const Mesh *level = m.drawn_level;
+    if (level && id[1] < m.instance_count() && id[2] < level->triangles.size() / 3)
+    {
+        mat4x4 t, inverse;
+        m.instance_transform(id[1], t);
+        mat4x4_invert(inverse, t);
+        TrianglePack pack;
+        unsigned int face = id[2];
+        pack_triangles(pack, level->vertices.data(), level->triangles.data(), &face, 1);
+        Ray rays[2] = { pick_ray(mouse_x, mouse_y), pick_ray(px + 0.5, height - py - 0.5) };
+        for (const Ray &ray : rays)
         {
-            float f = ray.distance_from(pt);
-            if (f > 0.3f)
-                continue;
-            float d = ray.distance_along(pt);
-            if (first)
-            {
-                first = false;
-                dist = d;
-                nearest = pt;
-            }
-            else if (d < dist)
+            Ray local = { transform_point(inverse, ray.pt), transform_direction(inverse, ray.dir) };
+            RayHit hit;
+            if (ray_hits_packs(local, &pack, 1, hit))
             {
-                dist = d;
-                nearest = pt;
+                v = ray.pt + ray.dir * hit.t;
+                return true;
             }
         }
     }
 
-    if (first)
-        debug_print("no nearest\n");
+    mat4x4 proj_inverse;
+    mat4x4_invert(proj_inverse, projection);
+    mat4x4 mv_inverse;
+    mat4x4_invert(mv_inverse, modelview);
+    vec4 ndc = { (2.0f * (px + 0.5f)) / width - 1.0f, (2.0f * (py + 0.5f)) / height - 1.0f, 2.0f * depth - 1.0f, 1.0f };
+    vec4 eye;
+    mat4x4_mul_vec4(eye, proj_inverse, ndc);
+    vec4 world;
+    mat4x4_mul_vec4(world, mv_inverse, eye);
+    v = Vector{ world[0] / world[3], world[1] / world[3], world[2] / world[3] };
+    return true;
+}
+
+void Scene::hover_pick()
+{
+    // Building the search trees here would stall the cursor, so they are built in the background and
+    // the pick waits for the event sent when each is done
+    bool ready = true;
+    for (const auto &m : m_objects)
+    {
+        if (!m->include_in_scene_box)
+            continue;
+        if (!gpu_pick)
+        {
+            m->start_bvh();
+            if (!m->bvh_ready && !m->triangles.empty())
+                ready = false;
+        }
+        if (snap)
+        {
+            m->start_point_tree();
+            if (!m->point_tree_ready && !m->vertices.empty())
+                ready = false;
+        }
+    }
+
+    char buf[256] = "";
+    if (!ready)
+        snprintf(buf, sizeof(buf), "Hover: indexing");
     else
     {
-        debug_print("nearest %g %g %g\n", nearest.x, nearest.y, nearest.z);
-        v = nearest;
+        hover_pending = false;
+        Vector c;
+        if (pick(hover_x, hover_y, c))
+        {
+            int n = snprintf(buf, sizeof(buf), "Hover: (%7.3f,%7.3f,%7.3f)", c.x, c.y, c.z);
+            if (m_pickCount > 0)
+            {
+                // The last pick is the one before the next to be made
+                Vector last = m_nextPick == 1 ? m_pick2 : m_pick1;
+                snprintf(buf + n, sizeof(buf) - n, "  to pick: (%7.3f)", (c - last).length());
+            }
+        }
     }
 
-    return !first;
+    if (hover_message != buf)
+    {
+        hover_message = buf;
+        redraw_needed = true;
+    }
 }
 
-bool Scene::fire_line(const Ray &ray, Vector &v)
+bool Scene::fire_point(const Ray &ray, float radius, float spread, float t_max, Vector &v)
 {
-    Vector nearest;
-    float dist = FLT_MAX;
-    bool first = true;
-
+    // Each instance is searched in the mesh's own coordinates, where the snapping distance shrinks by
+    // the instance's scale
+    float score = 1.0f;
+    bool found = false;
     for (const auto &m : m_objects)
     {
         if (!m->include_in_scene_box)
             continue;
-
-        const Vector *vertices = &m->vertices[0];
-        const unsigned int  *triangles = &m->triangles[0];
-
-        for (size_t i = 0; i < m->triangles.size(); i += 3)
-        {
-            Vector side1 = vertices[triangles[i + 1]] - vertices[triangles[i]];
-            Vector side2 = vertices[triangles[i + 2]] - vertices[triangles[i]];
-            Vector triNorm = cross(side1, side2).normalize();
-            float d = dot(triNorm, ray.dir);
-            Vector w = ray.pt - vertices[triangles[i]];
-            float s = dot(triNorm, w) / d;
-            Vector intx = ray.pt - ray.dir * s;
-            float atot = cross(side1, side2).length() / 2.0f;
-            float ax1 = cross(intx - vertices[triangles[i]], side2).length() / 2.0f;
-            float ax2 = cross(intx - vertices[triangles[i + 1]], -side1).length() / 2.0f;
-            float ax3 = cross(intx - vertices[triangles[i + 2]], vertices[triangles[i + 1]] - vertices[triangles[i + 2]]).length() / 2.0f;
-            //debug_print("pt %g %g %g\n", intx.x, intx.y, intx.z);
-            if (fabs(atot - ax1 - ax2 - ax3) < atot * 1e-6)
-            {
-                if (first)
-                {
-                    first = false;
-                    dist = s;
-                    nearest = intx;
-                }
-                else if (s > dist)
-                {
-                    dist = s;
-                    nearest = intx;
-                }
+        for (size_t k = 0; k < m->instance_count(); ++k)
+        {
+            mat4x4 t, inverse;
+            m->instance_transform(k, t);
+            mat4x4_invert(inverse, t);
+            Ray local = { transform_point(inverse, ray.pt), transform_direction(inverse, ray.dir) };
+            float s = transform_scale(t);
+            Vector p;
+            if (m->closest_vertex(local, radius / s, spread / s, t_max, score, p))
+            {
+                v = transform_point(t, p);
+                found = true;
             }
         }
     }
+    return found;
+}
 
-    if (first)
-        debug_print("no nearest\n");
-    else
+bool Scene::fire_line(const Ray &ray, Vector &v)
+{
+    // Each instance is hit in the mesh's own coordinates, where distances along the ray are the same
+    RayHit nearest;
+    for (const auto &m : m_objects)
     {
-        debug_print("nearest %g %g %g\n", nearest.x, nearest.y, nearest.z);
-        v = nearest;
+        if (!m->include_in_scene_box)
+            continue;
+
+        for (size_t k = 0; k < m->instance_count(); ++k)
+        {
+            mat4x4 t, inverse;
+            m->instance_transform(k, t);
+            mat4x4_invert(inverse, t);
+            Ray local = { transform_point(inverse, ray.pt), transform_direction(inverse, ray.dir) };
+            m->intersect(local, nearest);
+        }
     }
 
-    return !first;
+    if (nearest.t == FLT_MAX)
+        return false;
+
+    v = ray.pt + ray.dir * nearest.t;
+    return true;
 }
 
 //========================================================================
@@ -1139,6 +4998,7 @@ void Scene::scroll_callback(double x, double y)
     zoom += (float) y / 4.f;
     if (zoom < 0)
         zoom = 0;
+    redraw_needed = true;
 }
 
 void Scene::set_projection()
@@ -1156,9 +5016,9 @@ void Scene::set_projection()
 
     // Setup viewport
     glViewport(0, 0, width, height);
+    viewport_height = (std::max)(height, 1);
 
-    // Change to the projection matrix and set our viewing volume
-    glMatrixMode(GL_PROJECTION);
+    // Set our viewing volume, the next draw hands it to the mesh shader
     if (perspective)
         mat4x4_perspective(projection,
             60.f * (float)M_PI / 180.f,
@@ -1166,7 +5026,7 @@ void Scene::set_projection()
             1.f, 1024.f);
     else
         mat4x4_ortho(projection, -ratio, ratio, -1, 1, -10, 10);
-    glLoadMatrixf((const GLfloat*)projection);
+    redraw_needed = true;
 }
 
 static void framebuffer_size_callback(GLFWwindow* window, int width, int height)
@@ -1174,6 +5034,12 @@ static void framebuffer_size_callback(GLFWwindow* window, int width, int height)
     scene.set_projection();
 }
 
+// The window was uncovered or otherwise lost its contents
+static void window_refresh_callback(GLFWwindow *window)
+{
+    redraw_needed = true;
+}
+
 static void drop_callback(GLFWwindow *window, int n_files, const char** files)
 {
     scene.clear();
@@ -1184,16 +5050,202 @@ static void drop_callback(GLFWwindow *window, int n_files, const char** files)
         m->read_stl(files[i]);
         scene.m_objects.push_back(std::move(m));
     }
+    scene.start_instancing();
 
     scene.autoscale();
 }
 
+// Times the ASCII STL number parser against the strtod route it replaced over every number in a file
+static void benchmark_parse(const char *filename)
+{
+    MappedFile file;
+    if (!file.open(filename))
+    {
+        debug_print("cannot map %s\n", filename);
+        return;
+    }
+
+    std::vector<std::pair<const char *, size_t>> numbers;
+    Tokenizer tokens = { (const char *)file.data, (const char *)file.data + file.size };
+    const char *token;
+    size_t length;
+    while (tokens.next(token, length))
+    {
+        if ((token[0] >= '0' && token[0] <= '9') || token[0] == '-' || token[0] == '+' || token[0] == '.')
+            numbers.push_back(std::make_pair(token, length));
+    }
+
+    auto strtod_route = [](const char *text, size_t text_length, float *f)
+    {
+        char buf[64];
+        if (text_length >= sizeof(buf))
+            return false;
+        memcpy(buf, text, text_length);
+        buf[text_length] = '\0';
+        char *end;
+        double d = strtod(buf, &end);
+        if (*end != '\0' || d > FLT_MAX || d < -FLT_MAX)
+            return false;
+        *f = (float)d;
+        return true;
+    };
+
+    std::vector<float> old_values(numbers.size());
+    std::vector<float> new_values(numbers.size());
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < numbers.size(); ++i)
+        strtod_route(numbers[i].first, numbers[i].second, &old_values[i]);
+    auto t1 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < numbers.size(); ++i)
+        parse_real(numbers[i].first, numbers[i].second, &new_values[i]);
+    auto t2 = std::chrono::steady_clock::now();
+
+    size_t differ = 0;
+    for (size_t i = 0; i < numbers.size(); ++i)
+    {
+        if (memcmp(&old_values[i], &new_values[i], sizeof(float)) != 0)
+            ++differ;
+    }
+
+    double old_time = std::chrono::duration<double>(t1 - t0).count();
+    double new_time = std::chrono::duration<double>(t2 - t1).count();
+    debug_print("%zu numbers: strtod %.3fs (%.1f M/s), parse_real %.3fs (%.1f M/s), %zu results differ\n",
+        numbers.size(), old_time, numbers.size() / old_time / 1e6, new_time, numbers.size() / new_time / 1e6, differ);
+}
+
+// Times picking rays through a mesh: the area sum test picking used to do for each triangle, the
+// packed ray test over every triangle, and the packed test in the hierarchy's leaves
+static void benchmark_pick(const char *filename)
+{
+    Mesh m;
+    m.read_stl(filename);
+    size_t n_faces = m.triangles.size() / 3;
+    if (n_faces == 0)
+        return;
+
+    auto area_sum_route = [](const Ray &ray, const Vector &a, const Vector &b, const Vector &c, float &t)
+    {
+        Vector side1 = b - a;
+        Vector side2 = c - a;
+        Vector triNorm = cross(side1, side2).normalize();
+        float d = dot(triNorm, ray.dir);
+        t = dot(triNorm, a - ray.pt) / d;
+        Vector intx = ray.pt + ray.dir * t;
+        float atot = cross(side1, side2).length() / 2.0f;
+        float ax1 = cross(intx - a, side2).length() / 2.0f;
+        float ax2 = cross(intx - b, -side1).length() / 2.0f;
+        float ax3 = cross(intx - c, b - c).length() / 2.0f;
+        return fabs(atot - ax1 - ax2 - ax3) < atot * 1e-6;
+    };
+
+    // Rays from outside the box towards points inside it, so most of them hit something
+    Box b = m.model_box();
+    Vector center = b.center();
+    float size = b.size();
+    std::mt19937 random;
+    std::uniform_real_distribution<float> unit(-0.5f, 0.5f);
+    const int n_rays = 16;
+    std::vector<Ray> rays(n_rays);
+    for (Ray &r : rays)
+    {
+        Vector target = center + Vector{ unit(random) * (b.xmax - b.xmin), unit(random) * (b.ymax - b.ymin), unit(random) * (b.zmax - b.zmin) };
+        Vector from = center + Vector{ unit(random), unit(random), unit(random) }.normalize() * (size * 2.0f);
+        r = { from, (target - from).normalize() };
+    }
+
+    m.make_bvh();
+
+    std::vector<float> old_t(n_rays, FLT_MAX);
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < n_rays; ++i)
+    {
+        for (size_t f = 0; f < n_faces; ++f)
+        {
+            const unsigned int *tri = &m.triangles[f * 3];
+            float s;
+            if (area_sum_route(rays[i], m.vertices[tri[0]], m.vertices[tri[1]], m.vertices[tri[2]], s) && s >= 0.0f && s < old_t[i])
+                old_t[i] = s;
+        }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    std::vector<RayHit> brute(n_rays);
+    for (int i = 0; i < n_rays; ++i)
+        ray_hits_packs(rays[i], m.bvh_packs.data(), m.bvh_packs.size(), brute[i]);
+    auto t2 = std::chrono::steady_clock::now();
+    std::vector<RayHit> tree(n_rays);
+    const int tree_rounds = 1000;
+    for (int k = 0; k < tree_rounds; ++k)
+    {
+        for (int i = 0; i < n_rays; ++i)
+        {
+            tree[i] = RayHit();
+            m.intersect(rays[i], tree[i]);
+        }
+    }
+    auto t3 = std::chrono::steady_clock::now();
+
+    int hits = 0, misses = 0, differ = 0;
+    for (int i = 0; i < n_rays; ++i)
+    {
+        if (brute[i].t != FLT_MAX)
+            ++hits;
+        if ((old_t[i] == FLT_MAX) != (brute[i].t == FLT_MAX))
+            ++misses;
+        if (tree[i].t != brute[i].t)
+            ++differ;
+    }
+
+    double tests = (double)n_faces * n_rays;
+    double old_time = std::chrono::duration<double>(t1 - t0).count();
+    double brute_time = std::chrono::duration<double>(t2 - t1).count();
+    double tree_time = std::chrono::duration<double>(t3 - t2).count() / tree_rounds;
+    debug_print("%zu triangles, %d rays, %d hit: area sum %.1f M/s, packed %.1f M/s, bvh %.2f us per ray\n",
+        n_faces, n_rays, hits, tests / old_time / 1e6, tests / brute_time / 1e6, tree_time * 1e6 / n_rays);
+    debug_print("%d rays hit or missed only with the area sum test, %d differ between packed and bvh\n", misses, differ);
+}
+
+// Handles the load options that may come before the file name, returns false for anything else
+static bool parse_option(const char *arg)
+{
+    if (strcmp(arg, "-weld=hash") == 0)
+        weld_mode = WeldMode::Hash;
+    else if (strcmp(arg, "-weld=sort") == 0)
+        weld_mode = WeldMode::Sort;
+    else if (strncmp(arg, "-weld-tolerance=", 16) == 0)
+        weld_tolerance = (float)atof(arg + 16);
+    else if (strncmp(arg, "-crease=", 8) == 0)
+        crease_angle = (float)atof(arg + 8);
+    else if (strncmp(arg, "-feature-angle=", 15) == 0)
+        feature_angle = (float)atof(arg + 15);
+    else if (strcmp(arg, "-instances=off") == 0)
+        find_duplicates = false;
+    else
+        return false;
+    return true;
+}
+
 int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow)
 {
     const char *filename = nullptr;
 
-    if (__argc > 1)
-        filename = __argv[1];
+    int arg = 1;
+    while (arg < __argc && parse_option(__argv[arg]))
+        ++arg;
+    if (arg < __argc)
+        filename = __argv[arg];
+
+    if (filename != nullptr && strcmp(filename, "-bench-parse") == 0)
+    {
+        if (arg + 1 < __argc)
+            benchmark_parse(__argv[arg + 1]);
+        exit(EXIT_SUCCESS);
+    }
+    if (filename != nullptr && strcmp(filename, "-bench-pick") == 0)
+    {
+        if (arg + 1 < __argc)
+            benchmark_pick(__argv[arg + 1]);
+        exit(EXIT_SUCCESS);
+    }
 
     GLFWwindow* window;
     int width, height;
@@ -1203,6 +5255,12 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
     if (!glfwInit())
         exit(EXIT_FAILURE);
 
+    // Shaders only, so a core context is enough and software GL such as llvmpipe can run it
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+
     window = glfwCreateWindow(640, 480, "3D Viewer", NULL, NULL);
     if (!window)
     {
@@ -1217,6 +5275,7 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
     glfwSetCursorPosCallback(window, cursor_position_callback);
     glfwSetScrollCallback(window, scroll_callback);
     glfwSetDropCallback(window, drop_callback);
+    glfwSetWindowRefreshCallback(window, window_refresh_callback);
 
     glfwMakeContextCurrent(window);
     gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
@@ -1239,23 +5298,28 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
     {
         if (strcmp(filename, "-spheres") == 0)
         {
+            // One sphere drawn at the corners of a cube
+            std::unique_ptr<Mesh> m = std::make_unique<Mesh>();
+            m->make_sphere(5.0f, Vector{ 0.0f, 0.0f, 0.0f });
             for (int i = 0; i < 8; ++i)
             {
-                std::unique_ptr<Mesh> m = std::make_unique<Mesh>();
-                Vector c = { (i & 1) * 10.0f, ((i & 2) >> 1) * 10.0f, ((i & 4) >> 2) * 10.0f };
-                m->make_sphere(5.0f, c);
+                Instance instance;
+                mat4x4_translate(instance.transform, (i & 1) * 10.0f, ((i & 2) >> 1) * 10.0f, ((i & 4) >> 2) * 10.0f);
+                instance.color = m->color;
                 if ((i & 1) != 0)
-                    m->color = Color{ 0.9f, 0.2f, 0.2f };
+                    instance.color = Color{ 0.9f, 0.2f, 0.2f };
                 if (i == 7)
-                    m->color = Color{ 0.2f, 0.9f, 0.2f };
-                scene.m_objects.push_back(std::move(m));
+                    instance.color = Color{ 0.2f, 0.9f, 0.2f };
+                m->instances.push_back(instance);
             }
+            scene.m_objects.push_back(std::move(m));
         }
         else
         {
             std::unique_ptr<Mesh> m = std::make_unique<Mesh>();
             m->read_stl(filename);
             scene.m_objects.push_back(std::move(m));
+            scene.start_instancing();
         }
     }
 
@@ -1264,13 +5328,28 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
 
     while (!glfwWindowShouldClose(window))
     {
-        scene.draw();
-
-        glfwWaitEventsTimeout(0.1);
+        // Draw only when something changed, cutting detail while the view is dragged and putting it
+        // back once the view stays still, and sleep until the next event. Cursor moves since the
+        // last pass make one hover pick between them.
+        bool dragging = glfwGetInputMode(window, GLFW_CURSOR) == GLFW_CURSOR_DISABLED;
+        scene.finish_instancing();
+        if (scene.hover_pending && !dragging)
+            scene.hover_pick();
+        if (redraw_needed.exchange(false))
+            scene.draw(dragging);
+        else if (scene.proxy_shown && glfwGetTime() - scene.last_draw_time >= scene.settle_time)
+            scene.draw(false);
+
+        if (scene.proxy_shown)
+            glfwWaitEventsTimeout(scene.settle_time);
+        else
+            glfwWaitEvents();
         //alpha += 5;
-        //glfwPollEvents();
     }
 
+    // Meshes free their buffer objects so they have to go while the context is still alive
+    scene.clear();
+    scene.release_opengl();
     glfwTerminate();
     exit(EXIT_SUCCESS);
 }